@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <iostream>
 #include <string>
+#include <vector>
 #include <string.h>
 #ifdef _MSC_VER
 #include <windows.h>
@@ -52,7 +53,6 @@ int main(int argc, char *argv[])
     unsigned long diff = (1000000 * (end.tv_sec - start.tv_sec)+end.tv_usec-start.tv_usec)/1000;
 #endif
 #endif
-    free(buff);
     size_t slen = len;
     const char *source = buff;
 #else    
@@ -99,6 +99,9 @@ int main(int argc, char *argv[])
 #endif
         printf("\n%s\n", "parse ok");        
     }
+#if TESTFILE
+    free(buff);
+#endif
 
 #ifdef _MSC_VER
     system("pause");
@@ -108,34 +111,34 @@ int main(int argc, char *argv[])
 
 void dump_print( const tjson::Value &root, std::string &inden, bool bInden )
 {    
-    if (root.IsString())
+    if (root.isString())
     {
-        printf("%s\"%s\"", bInden?inden.c_str():"", root.AsString());
+        printf("%s\"%s\"", bInden?inden.c_str():"", root.asCString());
     }
-    else if (root.IsInteger())
+    else if (root.isInt())
     {
-        printf("%s%lld", bInden?inden.c_str():"", root.AsInteger());
+        printf("%s%lld", bInden?inden.c_str():"", root.asInt());
     }
-    else if (root.IsFloat())
+    else if (root.isDouble())
     {
-        printf("%s%lf", bInden?inden.c_str():"", root.AsFloat());
+        printf("%s%lf", bInden?inden.c_str():"", root.asDouble());
     }
-    else if (root.IsBool())
+    else if (root.isBool())
     {
-        printf("%s%s", bInden?inden.c_str():"", root.AsBool()?"true":"false");
+        printf("%s%s", bInden?inden.c_str():"", root.asBool()?"true":"false");
     }
-    else if (root.IsNull())
+    else if (root.isNull())
     {
         printf("%s%s", bInden?inden.c_str():"", "null");
     }
-    else if (root.IsArray())
+    else if (root.isArray())
     {
         printf("%s%s\n", bInden?inden.c_str():"", "[");
         inden += "  ";
-        for (size_t i = 0; i < root.Size(); i++)
+        for (size_t i = 0; i < root.size(); i++)
         {
             dump_print(root[i], inden, true);
-            if (i != root.Size() - 1)
+            if (i != root.size() - 1)
             {
                 printf("%s\n", ",");
             }
@@ -143,7 +146,7 @@ void dump_print( const tjson::Value &root, std::string &inden, bool bInden )
         inden.resize(inden.size() - 2);
         printf("\n%s%s", inden.c_str(), "]");
     }
-    else if (root.IsObject())
+    else if (root.isObject())
     {        
         printf("%s%s\n", bInden?inden.c_str():"", "{");
         inden += "  ";
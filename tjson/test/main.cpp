@@ -0,0 +1,29 @@
+#include "test.h"
+
+static test_case *tests = NULL;
+int test_failures = 0;
+
+test_case::test_case(const char *_name, void (*_fn)())
+    :name(_name),fn(_fn),next(tests)
+{
+    tests = this;
+}
+
+int main()
+{
+    int count = 0;
+    int failed = 0;
+    for (test_case *t = tests; t; t = t->next)
+    {
+        int before = test_failures;
+        t->fn();
+        count++;
+        if (test_failures != before)
+        {
+            failed++;
+            printf("FAILED %s\n", t->name);
+        }
+    }
+    printf("%d tests, %d failed\n", count, failed);
+    return failed ? 1 : 0;
+}
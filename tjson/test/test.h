@@ -0,0 +1,33 @@
+#ifndef TJSON_TEST_H
+#define TJSON_TEST_H
+
+#include "../tjson.h"
+#include <stdio.h>
+
+// TEST registers a test, CHECK counts a failed condition and carries on.
+// main.cpp runs them all and fails when any check did
+struct test_case
+{
+    test_case(const char *name, void (*fn)());
+    const char *name;
+    void (*fn)();
+    test_case *next;
+};
+
+extern int test_failures;
+
+#define TEST(name) \
+    static void name(); \
+    static test_case name##_case(#name, name); \
+    static void name()
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) \
+        { \
+            test_failures++; \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+        } \
+    } while (0)
+
+#endif
@@ -0,0 +1,219 @@
+#include "test.h"
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+// counts what is live, a tree built entirely from it accounts for every byte
+struct counting_allocator : public tjson::Allocator
+{
+    counting_allocator():live(0){}
+    void *allocate(size_t s)
+    {
+        live += s;
+        return malloc(s);
+    }
+    void deallocate(void *p, size_t s)
+    {
+        live -= s;
+        free(p);
+    }
+    size_t live;
+};
+
+static const char *LONG_STR = "a string far too long to sit inside a value";
+
+TEST(builders_take_the_container_allocator)
+{
+    counting_allocator a;
+    {
+        tjson::Value root;
+        CHECK(tjson::parse("{\"n\":null}", 10, &root, &a) == 0);
+        root["list"].append(tjson::Value(LONG_STR));
+        root["list"].append(tjson::Value(LONG_STR));
+        root["obj"].makeObject(32);
+        root["obj"].set("k", tjson::Value(LONG_STR));
+        root["arr"].makeArray(8);
+        root["arr"].append(tjson::Value(LONG_STR));
+        root[LONG_STR] = tjson::Value(LONG_STR);
+        root["n"].makeArray();
+        root["n"].append(1);
+        root["list"][(size_t)0] = tjson::Value(LONG_STR);
+        CHECK(root.size() == 5);
+        CHECK(root.memory_usage() == a.live);
+    }
+    CHECK(a.live == 0);
+}
+
+TEST(values_stored_into_an_arena_are_copied)
+{
+    counting_allocator a;
+    tjson::Value root;
+    CHECK(tjson::parse("[]", 2, &root, &a) == 0);
+    tjson::Value src;
+    src.makeArray();
+    src.append(tjson::Value(LONG_STR));
+    root.append(src);
+    root.append(src);
+    src.append(2);
+    CHECK(root[(size_t)0].size() == 1);
+    CHECK(root.memory_usage() == a.live);
+
+    // copies out of the tree do not carry its allocator away
+    tjson::Value copy = root[(size_t)1][(size_t)0];
+    tjson::Value n = root["missing"];
+    n.makeObject(4);
+    size_t live = a.live;
+    copy = tjson::Value(LONG_STR);
+    CHECK(a.live == live);
+}
+
+TEST(replaced_scalars_build_from_the_container_allocator)
+{
+    counting_allocator a;
+    {
+        tjson::Value root;
+        const char *s = "{\"a\":1,\"b\":[1,2.5,true],\"c\":\"short\",\"d\":\"fourteen chars\"}";
+        CHECK(tjson::parse(s, strlen(s), &root, &a) == 0);
+        root["a"] = tjson::Value(LONG_STR);
+        root["b"][(size_t)0].makeArray(4);
+        root["b"][(size_t)1].makeObject(4);
+        root["b"][(size_t)2] = tjson::Value(LONG_STR);
+        root["c"].makeArray(4);
+        root["d"] = tjson::Value(LONG_STR);
+        CHECK(root.memory_usage() == a.live);
+
+        // and the scalars and strings stored by hand
+        root["a"] = 5;
+        root["a"].makeObject(4);
+        root["c"] = "x";
+        root["c"] = tjson::Value(LONG_STR);
+        tjson::Value &slot = *root["b"].append(2.5);
+        slot.makeArray(4);
+        CHECK(root.memory_usage() == a.live);
+    }
+    CHECK(a.live == 0);
+}
+
+TEST(each_allocator_accounts_for_its_own_tree)
+{
+    counting_allocator a;
+    counting_allocator b;
+    {
+        tjson::Value first;
+        CHECK(tjson::parse("{\"n\":1,\"s\":[1]}", 15, &first, &a) == 0);
+        {
+            tjson::Value second;
+            CHECK(tjson::parse("[1,true]", 8, &second, &b) == 0);
+            // a scalar replaced by a container, and values moved across
+            first["n"].makeArray(4);
+            first["n"].append(tjson::Value(LONG_STR));
+            second[(size_t)1] = first["n"];
+            second[(size_t)0].makeObject(2);
+            first["s"][(size_t)0] = second[(size_t)1];
+            CHECK(first.memory_usage() == a.live);
+            CHECK(second.memory_usage() == b.live);
+        }
+        CHECK(b.live == 0);
+        CHECK(strcmp(first["s"][(size_t)0][(size_t)0].asCString(), LONG_STR) == 0);
+        CHECK(first.memory_usage() == a.live);
+    }
+    CHECK(a.live == 0);
+}
+
+TEST(replaced_document_scalars_stay_in_the_arena)
+{
+    tjson::Document doc;
+    CHECK(doc.parse("1", 1) == 0);
+    doc.root() = tjson::Value(LONG_STR);
+    CHECK(doc.root().memory_usage() > 0);
+    CHECK(doc.root().memory_usage() <= doc.memory_used());
+    CHECK(doc.parse("{\"a\":1,\"b\":[1,2]}", 17) == 0);
+    doc.root()["a"] = tjson::Value(LONG_STR);
+    doc.root()["b"][(size_t)0].makeArray(4);
+    CHECK(doc.root().memory_usage() <= doc.memory_used());
+}
+
+TEST(swapping_leaves_the_allocator_where_it_was)
+{
+    counting_allocator a;
+    tjson::Value root;
+    CHECK(tjson::parse("{\"n\":null}", 10, &root, &a) == 0);
+    tjson::Value &slot = root["n"];
+    tjson::Value outside;
+    slot.swap(outside);
+    size_t live = a.live;
+    outside.makeArray(4);
+    CHECK(a.live == live);
+    slot.makeArray(4);
+    CHECK(a.live > live);
+    CHECK(root.memory_usage() == a.live);
+}
+
+#if TJSON_HAS_RVALUE_REFS
+TEST(moving_leaves_the_allocator_where_it_was)
+{
+    counting_allocator a;
+    tjson::Value root;
+    CHECK(tjson::parse("{\"n\":null}", 10, &root, &a) == 0);
+    tjson::Value &slot = root["n"];
+    tjson::Value outside(static_cast<tjson::Value &&>(slot));
+    size_t live = a.live;
+    outside.makeArray(4);
+    CHECK(a.live == live);
+    slot.makeArray(4);
+    CHECK(a.live > live);
+    // assignment may copy into the arena, so it can throw
+    CHECK(!noexcept(outside = static_cast<tjson::Value &&>(slot)));
+}
+#endif
+
+// the resident size says little under ASan, which holds on to freed memory
+#if defined(__linux__) && !defined(__SANITIZE_ADDRESS__)
+static size_t resident_bytes()
+{
+    long pages = 0;
+    long resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f)
+    {
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+        {
+            resident = 0;
+        }
+        fclose(f);
+    }
+    return (size_t)resident * sysconf(_SC_PAGESIZE);
+}
+
+TEST(documents_built_in_a_loop_do_not_grow)
+{
+    size_t start = 0;
+    for (int i = 0; i < 100000; i++)
+    {
+        tjson::Document doc;
+        doc.root().makeObject();
+        doc.root()["a"].append(tjson::Value(LONG_STR));
+        doc.root()["b"].makeObject(32);
+        doc.root()["b"].set("long key of the inner object", tjson::Value(LONG_STR));
+        doc.root()["a long key that is not inline"] = tjson::Value(LONG_STR);
+        tjson::Document parsed;
+        parsed.parse("{\"a\":1,\"b\":[1,2],\"c\":\"x\"}", 25);
+        parsed.root()["a"] = tjson::Value(LONG_STR);
+        parsed.root()["b"][(size_t)0].makeArray(4);
+        parsed.root()["c"].makeObject(4);
+        if (i == 0)
+        {
+            CHECK(doc.root().memory_usage() <= doc.memory_used());
+            CHECK(parsed.root().memory_usage() <= parsed.memory_used());
+        }
+        else if (i == 1000)
+        {
+            start = resident_bytes();
+        }
+    }
+    // a leak of the builds above comes to well over 100 MB
+    CHECK(resident_bytes() < start + 8 * 1024 * 1024);
+}
+#endif
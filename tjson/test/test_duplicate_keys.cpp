@@ -0,0 +1,77 @@
+#include "test.h"
+#include <string.h>
+#include <string>
+
+static const char *DOC = "{\"a\":1,\"b\":2,\"a\":3}";
+
+// the tree as text, or empty when the parse failed at the expected place
+static std::string parsed(tjson::DuplicateKeys dup)
+{
+    tjson::Value v;
+    size_t err = tjson::parse(DOC, strlen(DOC), &v, NULL, dup);
+    if (err)
+    {
+        // positions count from 1, the repeated key starts at 13
+        return err == 14 ? "" : "wrong position";
+    }
+    tjson::Writer w;
+    return w.write(v);
+}
+
+TEST(duplicate_key_policies)
+{
+    CHECK(parsed(tjson::JD_LAST_WINS) == "{\"a\":3,\"b\":2}");
+    CHECK(parsed(tjson::JD_FIRST_WINS) == "{\"a\":1,\"b\":2}");
+    CHECK(parsed(tjson::JD_ERROR) == "");
+    CHECK(parsed(tjson::JD_KEEP_ALL) == "{\"a\":1,\"b\":2,\"a\":3}");
+
+    tjson::Value v;
+    CHECK(tjson::parse(DOC, strlen(DOC), &v, NULL, tjson::JD_KEEP_ALL) == 0);
+    CHECK(v.size() == 3 && v["a"].asInt() == 1);
+}
+
+TEST(duplicate_keys_in_nested_and_long_keys)
+{
+    const char *s = "{\"k\":{\"x\":1},\"k\":[2],\"o\":{\"a long key that is not inline\":1,\"a long key that is not inline\":2}}";
+    tjson::Value last;
+    CHECK(tjson::parse(s, strlen(s), &last) == 0);
+    CHECK(last["k"].isArray() && last["o"].size() == 1);
+    CHECK(last["o"]["a long key that is not inline"].asInt() == 2);
+    tjson::Value first;
+    CHECK(tjson::parse(s, strlen(s), &first, NULL, tjson::JD_FIRST_WINS) == 0);
+    CHECK(first["k"].isObject() && first["o"]["a long key that is not inline"].asInt() == 1);
+    // objects are checked as they close, so the inner repeat is the one
+    // reported
+    tjson::Value error;
+    CHECK(tjson::parse(s, strlen(s), &error, NULL, tjson::JD_ERROR) == 61);
+    tjson::Value outer;
+    CHECK(tjson::parse("{\"k\":{\"x\":1},\"k\":[2]}", 21, &outer, NULL, tjson::JD_ERROR) == 14);
+}
+
+TEST(every_parser_applies_the_policy)
+{
+    tjson::Document doc;
+    CHECK(doc.parse(DOC, strlen(DOC), tjson::JD_FIRST_WINS) == 0);
+    CHECK(doc.root()["a"].asInt() == 1);
+    CHECK(doc.parse(DOC, strlen(DOC), tjson::JD_ERROR) == 14);
+
+    tjson::Parser p;
+    tjson::Value error;
+    p.set_duplicate_keys(tjson::JD_ERROR);
+    CHECK(p.parse(DOC, strlen(DOC), &error) == 14);
+    tjson::Value pushed;
+    p.start(&pushed);
+    CHECK(p.feed(DOC, 10) == 0);
+    CHECK(p.feed(DOC + 10, strlen(DOC) - 10) == 14);
+    tjson::Value all;
+    p.set_duplicate_keys(tjson::JD_KEEP_ALL);
+    CHECK(p.parse(DOC, strlen(DOC), &all) == 0 && all.size() == 3);
+
+    tjson::LineReader lines;
+    lines.set_duplicate_keys(tjson::JD_FIRST_WINS);
+    std::string text = std::string(DOC) + "\n" + DOC + "\n";
+    lines.start(text.data(), text.size());
+    CHECK(lines.next() && lines.error() == 0 && lines.root()["a"].asInt() == 1);
+    CHECK(lines.next() && lines.line() == 2 && lines.root()["a"].asInt() == 1);
+    CHECK(!lines.next());
+}
@@ -0,0 +1,154 @@
+#include "test.h"
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// every event as a word, stopping the parse at event number stop_at
+struct recorder : public tjson::Handler
+{
+    recorder(int stop_at = 0) :left(stop_at) {}
+    bool event(const std::string &e)
+    {
+        text += text.empty() ? e : " " + e;
+        return --left != 0;
+    }
+    bool event(const char *kind, long long n)
+    {
+        char buf[32];
+        sprintf(buf, "%s%lld", kind, n);
+        return event(buf);
+    }
+    bool Null() { return event("n"); }
+    bool Bool(bool b) { return event(b ? "t" : "f"); }
+    bool Int(long long i) { return event("i", i); }
+    bool Double(double d)
+    {
+        char buf[32];
+        sprintf(buf, "d%g", d);
+        return event(buf);
+    }
+    bool String(const char *s, size_t len) { return event("s" + std::string(s, len)); }
+    bool StartObject() { return event("{"); }
+    bool Key(const char *s, size_t len) { return event("k" + std::string(s, len)); }
+    bool EndObject(size_t n) { return event("}", (long long)n); }
+    bool StartArray() { return event("["); }
+    bool EndArray(size_t n) { return event("]", (long long)n); }
+    int left;
+    std::string text;
+};
+
+// the tree the events describe
+struct builder : public tjson::Handler
+{
+    tjson::Value *slot()
+    {
+        if (stack.empty())
+        {
+            return &root;
+        }
+        tjson::Value *top = stack.back();
+        return top->isArray() ? top->append(tjson::Value()) : top->set(key.c_str(), tjson::Value());
+    }
+    bool Null() { slot(); return true; }
+    bool Bool(bool b) { *slot() = tjson::Value(b); return true; }
+    bool Int(long long i) { *slot() = tjson::Value(i); return true; }
+    bool Double(double d) { *slot() = tjson::Value(d); return true; }
+    bool String(const char *s, size_t len) { *slot() = tjson::Value(std::string(s, len).c_str()); return true; }
+    bool StartObject() { tjson::Value *v = slot(); v->makeObject(); stack.push_back(v); return true; }
+    bool Key(const char *s, size_t len) { key.assign(s, len); return true; }
+    bool EndObject(size_t) { stack.pop_back(); return true; }
+    bool StartArray() { tjson::Value *v = slot(); v->makeArray(); stack.push_back(v); return true; }
+    bool EndArray(size_t) { stack.pop_back(); return true; }
+    tjson::Value root;
+    std::vector<tjson::Value *> stack;
+    std::string key;
+};
+
+static const char *DOC = "{\"a\":[1,2.5,\"x\",null,true],\"b\":{\"c\":{}}, \"a\":false}";
+
+TEST(events_come_in_document_order)
+{
+    recorder r;
+    CHECK(tjson::parse(DOC, strlen(DOC), &r) == 0);
+    CHECK(r.text == "{ ka [ i1 d2.5 sx n t ]5 kb { kc { }0 }1 ka f }3");
+    recorder nested;
+    CHECK(tjson::parse("[[[]],{\"k\":[{}]}]", 17, &nested) == 0);
+    CHECK(nested.text == "[ [ [ ]0 ]1 { kk [ { }0 ]1 }1 ]2");
+    recorder scalar;
+    CHECK(tjson::parse(" \"a\\tb\" ", 8, &scalar) == 0);
+    CHECK(scalar.text == "sa\tb");
+}
+
+TEST(events_rebuild_the_tree_parse_builds)
+{
+    const char *docs[] =
+    {
+        DOC,
+        "[0,-0,1E400,0.000001,9223372036854775807,-9223372036854775808,123456789012345678901234567890]",
+        "{\"a string too long to be inline\":\"\\u00e9\\ud83d\\ude00 \\\" \\\\ \\n\",\"k\":[[],{}]}",
+        "  [  1 , { \"k\" : \"v\" } , true , false , null ]  ",
+        "\"s\"",
+    };
+    tjson::Writer w;
+    tjson::Parser p;
+    for (size_t i = 0; i < sizeof(docs) / sizeof(docs[0]); i++)
+    {
+        tjson::Value dom;
+        CHECK(tjson::parse(docs[i], strlen(docs[i]), &dom) == 0);
+        std::string expected = w.write(dom);
+        builder b;
+        CHECK(tjson::parse(docs[i], strlen(docs[i]), &b) == 0);
+        CHECK(expected == w.write(b.root));
+        builder reused;
+        CHECK(p.parse(docs[i], strlen(docs[i]), &reused) == 0);
+        CHECK(expected == w.write(reused.root));
+        builder pushed;
+        p.start(&pushed);
+        for (const char *s = docs[i]; *s; s++)
+        {
+            CHECK(p.feed(s, 1) == 0);
+        }
+        CHECK(p.finish() == 0);
+        CHECK(expected == w.write(pushed.root));
+    }
+}
+
+TEST(returning_false_stops_where_the_event_starts)
+{
+    // the position of the token behind each event
+    size_t at[] = {1, 2, 6, 7, 9, 13, 17, 22, 26, 28, 32, 33, 37, 38, 39, 42, 46, 51};
+    recorder all;
+    tjson::parse(DOC, strlen(DOC), &all);
+    for (size_t i = 0; i < sizeof(at) / sizeof(at[0]); i++)
+    {
+        recorder r((int)i + 1);
+        CHECK(tjson::parse(DOC, strlen(DOC), &r) == at[i]);
+        // nothing after the refused event
+        CHECK(all.text.compare(0, r.text.size(), r.text) == 0);
+        CHECK(std::count(r.text.begin(), r.text.end(), ' ') == (int)i);
+    }
+    recorder r(6);
+    tjson::Parser p;
+    p.start(&r);
+    CHECK(p.feed(DOC, 10) == 0);
+    CHECK(p.feed(DOC + 10, strlen(DOC) - 10) == 13);
+    CHECK(p.finish() == 13);
+}
+
+TEST(errors_are_where_parse_reports_them)
+{
+    const char *bad[] =
+    {
+        "[1,2", "{\"a\":}", "[1,{\"k\" 2}]", "\"bad \\x\"", "[true false]",
+        "{\"x\":1}}", "{\"a\" 1}", "[,]", "", "[\"abc\\",
+    };
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++)
+    {
+        tjson::Value dom;
+        size_t err = tjson::parse(bad[i], strlen(bad[i]), &dom);
+        CHECK(err != 0);
+        recorder r;
+        CHECK(tjson::parse(bad[i], strlen(bad[i]), &r) == err);
+    }
+}
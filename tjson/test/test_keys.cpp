@@ -0,0 +1,124 @@
+#include "test.h"
+#include <string.h>
+#include <string>
+#include <vector>
+
+static const char *RECORD = "{\"customer_identifier\":1,\"id\":2,\"shipping_address_line\":{\"customer_identifier\":3},"
+    "\"tags\":[{\"shipping_address_line\":4}],\"customer_identifier\":5}";
+
+TEST(interned_keys_are_shared)
+{
+    tjson::KeyTable keys;
+    tjson::Parser p;
+    p.set_key_table(&keys);
+    std::vector<tjson::Value> trees(50);
+    for (size_t i = 0; i < trees.size(); i++)
+    {
+        CHECK(p.parse(RECORD, strlen(RECORD), &trees[i]) == 0);
+    }
+    // short keys sit inside their values and never reach the table
+    CHECK(keys.size() == 2);
+    size_t used = keys.memory_usage();
+    std::vector<const char *> first, other;
+    trees[0].GetKeys(&first);
+    trees[49].GetKeys(&other);
+    CHECK(first.size() == 4 && other.size() == 4);
+    CHECK(first[0] == other[0] && first[2] == other[2]);
+    CHECK(strcmp(first[0], "customer_identifier") == 0);
+    std::vector<const char *> nested;
+    trees[7]["shipping_address_line"].GetKeys(&nested);
+    CHECK(nested.size() == 1 && nested[0] == first[0]);
+    // the repeated key kept its first place and took the last value
+    CHECK(trees[3]["customer_identifier"].asInt() == 5);
+    CHECK(trees[3]["tags"][(size_t)0]["shipping_address_line"].asInt() == 4);
+
+    // more of the same keys cost the table nothing
+    for (int i = 0; i < 50; i++)
+    {
+        tjson::Document doc;
+        p.parse(RECORD, strlen(RECORD), &doc);
+    }
+    CHECK(keys.size() == 2 && keys.memory_usage() == used);
+
+    // without a table every tree has its own copy
+    tjson::Value a, b;
+    tjson::Parser plain;
+    CHECK(plain.parse(RECORD, strlen(RECORD), &a) == 0);
+    CHECK(plain.parse(RECORD, strlen(RECORD), &b) == 0);
+    first.clear();
+    other.clear();
+    a.GetKeys(&first);
+    b.GetKeys(&other);
+    CHECK(first[0] != other[0] && strcmp(first[0], other[0]) == 0);
+
+    trees.clear();
+    keys.clear();
+    CHECK(keys.size() == 0);
+}
+
+// FNV-1a written out again, independent of the header's
+static unsigned int fnv1a(const char *s, size_t len)
+{
+    unsigned int h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+    {
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
+    }
+    return h;
+}
+
+#if __cplusplus >= 201103L
+static constexpr tjson::Key COMPILED("customer_identifier");
+static_assert(COMPILED.size() == 19, "the length is worked out at compile time");
+static_assert(COMPILED.hash() == 0x19cad091u, "the hash is worked out at compile time");
+#endif
+
+TEST(key_hashes_match_the_runtime_hash)
+{
+    static const tjson::Key literal("customer_identifier");
+    std::string s("customer_identifier");
+    tjson::Key runtime(s.data(), s.size());
+    CHECK(literal.size() == 19 && literal.hash() == runtime.hash());
+    CHECK(literal.hash() == fnv1a(s.data(), s.size()));
+#if __cplusplus >= 201103L
+    CHECK(COMPILED.hash() == literal.hash());
+#endif
+    // a literal in a larger array ends at its 0
+    char buf[32] = "id";
+    tjson::Key padded(buf);
+    CHECK(padded.size() == 2 && padded.hash() == fnv1a("id", 2));
+    tjson::Key empty("");
+    CHECK(empty.size() == 0 && empty.hash() == fnv1a("", 0));
+}
+
+TEST(keys_find_members_in_indexed_objects)
+{
+    // enough members for the hash index, long and short keys both
+    std::string doc("{");
+    for (int i = 0; i < 40; i++)
+    {
+        char buf[64];
+        sprintf(buf, "%s\"%s%d\":%d", i ? "," : "", i % 2 ? "k" : "a_key_too_long_for_inline_", i, i);
+        doc += buf;
+    }
+    doc += "}";
+    tjson::KeyTable keys;
+    tjson::Parser p;
+    tjson::Value plain, interned;
+    CHECK(p.parse(doc.data(), doc.size(), &plain) == 0);
+    p.set_key_table(&keys);
+    CHECK(p.parse(doc.data(), doc.size(), &interned) == 0);
+    for (int i = 0; i < 40; i++)
+    {
+        char name[64];
+        sprintf(name, "%s%d", i % 2 ? "k" : "a_key_too_long_for_inline_", i);
+        tjson::Key k(name, strlen(name));
+        CHECK(plain[k].asInt() == i && interned[k].asInt() == i);
+        CHECK(plain.find(k) == &plain[name]);
+    }
+    static const tjson::Key missing("a_key_too_long_for_inline_99");
+    CHECK(plain.find(missing) == NULL && interned.find(missing) == NULL);
+    static const tjson::Key k1("k1");
+    static const tjson::Key long0("a_key_too_long_for_inline_0");
+    CHECK(plain[k1].asInt() == 1 && interned[long0].asInt() == 0);
+}
@@ -0,0 +1,107 @@
+#include "test.h"
+#include <string.h>
+#include <string>
+#include <vector>
+
+// each record as compact text, and each error as "line:pos"
+struct collector : public tjson::LineHandler
+{
+    collector(bool skip_errors = true) :skip(skip_errors) {}
+    bool record(size_t line, tjson::Value &root)
+    {
+        lines.push_back(line);
+        texts.push_back(w.write(root));
+        return true;
+    }
+    bool error(size_t line, size_t pos)
+    {
+        char buf[48];
+        sprintf(buf, "%lu:%lu", (unsigned long)line, (unsigned long)pos);
+        errors.push_back(buf);
+        return skip;
+    }
+    bool skip;
+    tjson::Writer w;
+    std::vector<size_t> lines;
+    std::vector<std::string> texts;
+    std::vector<std::string> errors;
+};
+
+TEST(records_end_in_lf_or_crlf)
+{
+    const char *s = "{\"a\":1}\r\n[1,2]\n\"s\"\r\n";
+    collector c;
+    tjson::LineReader r;
+    CHECK(r.read(s, strlen(s), &c) == 3);
+    CHECK(c.texts.size() == 3 && c.texts[0] == "{\"a\":1}" && c.texts[1] == "[1,2]"
+        && c.texts[2] == "\"s\"");
+    CHECK(c.lines.size() == 3 && c.lines[0] == 1 && c.lines[1] == 2 && c.lines[2] == 3);
+    CHECK(c.errors.empty());
+}
+
+TEST(blank_lines_are_skipped_but_counted)
+{
+    const char *s = "\n1\n\r\n  \t\n2\n\n";
+    collector c;
+    tjson::LineReader r;
+    CHECK(r.read(s, strlen(s), &c) == 2);
+    CHECK(c.lines.size() == 2 && c.lines[0] == 2 && c.lines[1] == 5);
+    CHECK(c.errors.empty());
+    CHECK(r.read("", 0, &c) == 0);
+    CHECK(r.read("\r\n\n", 3, &c) == 0);
+}
+
+TEST(the_last_line_needs_no_newline)
+{
+    const char *s = "[1]\n{\"k\":\"v\"}";
+    collector c;
+    tjson::LineReader r;
+    CHECK(r.read(s, strlen(s), &c) == 2);
+    CHECK(c.texts.size() == 2 && c.texts[1] == "{\"k\":\"v\"}" && c.lines[1] == 2);
+    // the record must not run past the buffer
+    std::string cut("[1]\n[2,3]xxxx");
+    collector d;
+    CHECK(r.read(cut.data(), cut.size() - 4, &d) == 2);
+    CHECK(d.texts.size() == 2 && d.texts[1] == "[2,3]");
+}
+
+TEST(errors_report_the_line_and_the_position_in_it)
+{
+    const char *s = "1\n2\n[1,\n{\"a\" 1}\n3\n";
+    collector c;
+    tjson::LineReader r;
+    CHECK(r.read(s, strlen(s), &c) == 3);
+    CHECK(c.errors.size() == 2 && c.errors[0] == "3:4" && c.errors[1] == "4:6");
+    CHECK(c.lines.size() == 3 && c.lines[2] == 5);
+    // an error handler returning false stops the reading
+    collector stop(false);
+    CHECK(r.read(s, strlen(s), &stop) == 2);
+    CHECK(stop.errors.size() == 1 && stop.errors[0] == "3:4");
+    // and the same through next()
+    r.start(s, strlen(s));
+    CHECK(r.next() && r.error() == 0 && r.root().asInt() == 1);
+    CHECK(r.next() && r.error() == 0 && r.line() == 2);
+    CHECK(r.next() && r.error() == 4 && r.line() == 3);
+    CHECK(r.next() && r.error() == 6 && r.line() == 4);
+    CHECK(r.next() && r.error() == 0 && r.line() == 5 && r.root().asInt() == 3);
+    CHECK(!r.next());
+}
+
+TEST(long_lines_are_read_whole)
+{
+    std::string big("[");
+    for (int i = 0; i < 100000; i++)
+    {
+        big += i ? ",\"0123456789\"" : "\"0123456789\"";
+    }
+    big += "]";
+    std::string s = "1\r\n" + big + "\r\n" + big + "\n2";
+    tjson::LineReader r;
+    r.start(s.data(), s.size());
+    CHECK(r.next() && r.error() == 0 && r.root().asInt() == 1);
+    CHECK(r.next() && r.error() == 0 && r.root().size() == 100000);
+    CHECK(r.next() && r.error() == 0 && r.root().size() == 100000 && r.line() == 3);
+    CHECK(strcmp(r.root()[(size_t)99999].asCString(), "0123456789") == 0);
+    CHECK(r.next() && r.error() == 0 && r.root().asInt() == 2 && r.line() == 4);
+    CHECK(!r.next());
+}
@@ -0,0 +1,181 @@
+#include "test.h"
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+// good and bad documents, with tokens of every kind for the splits to cut
+static const char *CASES[] =
+{
+    "{\"a\":[1,2.5,\"x\",null,true,{}],\"b\":{\"c\":[]}}",
+    "\"s\"",
+    "\"esc \\\" \\\\ \\/ \\b \\f \\n \\r \\t \xc3\xa9 \xf0\x9f\x98\x80 end\"",
+    "\"\\u00e9\\ud83d\\ude00\\u0000x\"",
+    "-12.5e+3",
+    "[0,-0,1E400,-1e-400,0.000001,9223372036854775807,-9223372036854775808]",
+    "123456789012345678901234567890",
+    "  [  1 , { \"k\" : \"v\" } , true , false , null ]  ",
+    "[[[[[[]]]]]]",
+    "{\"a\":1,\"a\":2}",
+    "{\"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa\":1,\"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa\":2}",
+    "{\"k\":{\"x\":1},\"k\":[2],\"j\":{\"k\":3,\"k\":4}}",
+    "[1,2",
+    "[{\"k\":1},]",
+    "[1,2,]",
+    "{\"a\":1,}",
+    "\"bad \\x\"",
+    "\"bad \\u12g4\"",
+    "\"\\ud83d\"",
+    "[tru]",
+    "[true false]",
+    "1e",
+    "nul",
+    "[ 1 , { kk : w } , 'single' ]",
+    "{\"x\":1}}",
+    "{\"x\":1} 2",
+    "{,}",
+    "{\"a\" 1}",
+    "{\"a\":}",
+    "[,]",
+    "",
+    "   ",
+    "[\"abc\\",
+};
+
+// the tree as text, or the error position
+static std::string outcome(size_t err, const tjson::Value &v, tjson::Writer &w)
+{
+    if (err)
+    {
+        char buf[32];
+        sprintf(buf, "error %lu", (unsigned long)err);
+        return buf;
+    }
+    return w.write(v);
+}
+
+// feeds doc in pieces of step bytes, each in its own allocation so that
+// nothing can be read past a piece unnoticed
+static size_t push(tjson::Parser &p, const std::string &doc, size_t step)
+{
+    size_t err = 0;
+    for (size_t i = 0; i < doc.size() && !err; i += step)
+    {
+        size_t n = doc.size() - i < step ? doc.size() - i : step;
+        char *piece = (char *)malloc(n);
+        memcpy(piece, doc.data() + i, n);
+        err = p.feed(piece, n);
+        free(piece);
+    }
+    return err ? err : p.finish();
+}
+
+static bool same_as_parse(tjson::Parser &p, const std::string &doc, size_t step, tjson::DuplicateKeys dup)
+{
+    tjson::Writer w;
+    tjson::Value a;
+    std::string expected = outcome(tjson::parse(doc.data(), doc.size(), &a, NULL, dup), a, w);
+    tjson::Value b;
+    p.set_duplicate_keys(dup);
+    p.start(&b);
+    std::string got = outcome(push(p, doc, step), b, w);
+    if (got != expected)
+    {
+        printf("step %lu of %.60s: %s, parse gives %s\n", (unsigned long)step,
+            doc.c_str(), got.c_str(), expected.c_str());
+        return false;
+    }
+    return true;
+}
+
+TEST(push_parse_matches_parse_for_every_split)
+{
+    tjson::Parser p;
+    for (size_t i = 0; i < sizeof(CASES) / sizeof(CASES[0]); i++)
+    {
+        std::string doc(CASES[i]);
+        for (size_t step = 1; step <= 40; step++)
+        {
+            CHECK(same_as_parse(p, doc, step, tjson::JD_LAST_WINS));
+            CHECK(same_as_parse(p, doc, step, tjson::JD_ERROR));
+        }
+    }
+}
+
+TEST(push_parse_matches_parse_for_a_long_document)
+{
+    std::string doc("[");
+    for (int i = 0; i < 300; i++)
+    {
+        char buf[128];
+        sprintf(buf, "%s{\"id\":%d,\"name\":\"item \\u00e9 %d\",\"score\":%d.%03d,\"tags\":[true,null]}",
+            i ? "," : "", i, i, i * 7, i % 1000);
+        doc += buf;
+    }
+    doc += "]";
+    tjson::Parser p;
+    for (size_t step = 1; step <= 40; step++)
+    {
+        CHECK(same_as_parse(p, doc, step, tjson::JD_LAST_WINS));
+    }
+    CHECK(same_as_parse(p, doc, doc.size(), tjson::JD_LAST_WINS));
+    // an error deep in, counted over everything fed
+    std::string bad = doc.substr(0, doc.size() / 2) + "x" + doc.substr(doc.size() / 2);
+    for (size_t step = 1; step <= 40; step += 3)
+    {
+        CHECK(same_as_parse(p, bad, step, tjson::JD_LAST_WINS));
+    }
+}
+
+TEST(push_parse_into_a_document)
+{
+    const char *s = "{\"a\":[1,2,3],\"b\":\"a string too long to be inline\"}";
+    tjson::Document doc;
+    tjson::Parser p;
+    for (size_t step = 1; step <= 8; step++)
+    {
+        p.start(&doc);
+        CHECK(push(p, s, step) == 0);
+        CHECK(doc.root()["a"].size() == 3);
+        CHECK(strcmp(doc.root()["b"].asCString(), "a string too long to be inline") == 0);
+    }
+}
+
+TEST(push_errors_stick_until_the_next_start)
+{
+    tjson::Parser p;
+    tjson::Value bad;
+    p.start(&bad);
+    CHECK(p.feed("[1,", 3) == 0);
+    size_t err = p.feed("}]", 2);
+    CHECK(err == 4);
+    CHECK(p.feed("2]", 2) == err);
+    CHECK(p.finish() == err);
+    tjson::Value v;
+    p.start(&v);
+    CHECK(p.feed("[1,", 3) == 0);
+    CHECK(p.feed("2]", 2) == 0);
+    CHECK(p.finish() == 0);
+    CHECK(v.size() == 2);
+}
+
+TEST(reset_drops_a_push_left_unfinished)
+{
+    tjson::Parser p;
+    tjson::Value left;
+    p.start(&left);
+    // stopped inside a split string, with a piece carried over
+    CHECK(p.feed("[1,[\"abc\\", 9) == 0);
+    p.reset();
+    tjson::Value v;
+    CHECK(p.parse("[2]", 3, &v) == 0 && v[(size_t)0].asInt() == 2);
+    // a fresh push counts from its own start, carried pieces included
+    tjson::Value w;
+    p.start(&w);
+    CHECK(p.feed("[\"ab", 4) == 0);
+    CHECK(p.feed("c\" x", 4) == 8);
+    CHECK(p.finish() == 8);
+    tjson::Value bad;
+    p.start(&bad);
+    CHECK(p.feed("[\"ab", 4) == 0);
+    CHECK(p.feed("\\q\"]", 4) == 6);
+}
@@ -0,0 +1,106 @@
+#include "test.h"
+#include <string.h>
+
+TEST(append_and_set_report_the_stored_value)
+{
+    tjson::Value v;
+    tjson::Value *a = v.append(1);
+    CHECK(a != NULL && a == &v[(size_t)0] && a->asInt() == 1);
+    tjson::Value o;
+    tjson::Value *s = o.set("k", tjson::Value("x"));
+    CHECK(s != NULL && s == &o["k"] && strcmp(s->asCString(), "x") == 0);
+    CHECK(o.set("k", 2) == s && s->asInt() == 2);
+}
+
+TEST(append_and_set_fail_on_the_wrong_type)
+{
+    tjson::Value i(7);
+    CHECK(i.append(1) == NULL);
+    CHECK(i.set("k", 1) == NULL);
+    CHECK(i.isInt() && i.asInt() == 7);
+
+    tjson::Value arr;
+    arr.makeArray();
+    CHECK(arr.set("k", 1) == NULL);
+    CHECK(arr.isArray() && arr.size() == 0);
+
+    tjson::Value obj;
+    obj.makeObject();
+    CHECK(obj.append(1) == NULL);
+    CHECK(obj.isObject() && obj.size() == 0);
+}
+
+TEST(indexing_the_wrong_type_leaves_the_value_alone)
+{
+    tjson::Value i(7);
+    CHECK(i["k"].isNull());
+    CHECK(i[(size_t)0].isNull());
+    CHECK(i.isInt() && i.asInt() == 7);
+    CHECK(i.find("k") == NULL);
+}
+
+TEST(typed_getters_read_their_own_type)
+{
+    const char *s = "{\"i\":-7,\"d\":2.75,\"b\":true,\"s\":\"text\",\"n\":null,\"o\":{},\"a\":[1]}";
+    tjson::Value v;
+    CHECK(tjson::parse(s, strlen(s), &v) == 0);
+    CHECK(v.getInt("i") == -7 && v.getDouble("d") == 2.75 && v.getBool("b"));
+    size_t len = 0;
+    CHECK(strcmp(v.getString("s", NULL, &len), "text") == 0 && len == 4);
+    static const tjson::Key ki("i");
+    CHECK(v.getInt(ki, 5) == -7);
+    // numbers convert to each other
+    CHECK(v.getInt("d") == 2 && v.getDouble("i") == -7.0);
+    long long i = 0;
+    double d = 0;
+    CHECK(v.tryGet("d", &i) && i == 2);
+    CHECK(v.tryGet("i", &d) && d == -7.0);
+}
+
+TEST(typed_getters_give_the_default_on_a_mismatch)
+{
+    const char *s = "{\"i\":-7,\"d\":2.75,\"b\":true,\"s\":\"12\",\"n\":null,\"o\":{},\"a\":[1]}";
+    tjson::Value v;
+    CHECK(tjson::parse(s, strlen(s), &v) == 0);
+    // missing
+    CHECK(v.getInt("x") == 0 && v.getInt("x", 9) == 9);
+    CHECK(v.getDouble("x") == 0 && v.getDouble("x", 1.5) == 1.5);
+    CHECK(!v.getBool("x") && v.getBool("x", true));
+    CHECK(v.getString("x") == NULL);
+    size_t len = 99;
+    CHECK(strcmp(v.getString("x", "def", &len), "def") == 0 && len == 3);
+    CHECK(v.getString("x", NULL, &len) == NULL && len == 0);
+    // present with another type: strings are not numbers, and neither
+    // numbers nor null are bools
+    CHECK(v.getInt("s", 9) == 9 && v.getInt("b", 9) == 9 && v.getInt("n", 9) == 9);
+    CHECK(v.getInt("o", 9) == 9 && v.getInt("a", 9) == 9);
+    CHECK(v.getDouble("s", 1.5) == 1.5 && v.getDouble("b", 1.5) == 1.5);
+    CHECK(v.getBool("i", true) && !v.getBool("n", false) && v.getBool("s", true));
+    CHECK(strcmp(v.getString("i", "def", &len), "def") == 0 && len == 3);
+    CHECK(v.getString("n") == NULL && v.getString("o") == NULL);
+    // tryGet leaves the output alone
+    long long i = 42;
+    bool b = false;
+    const char *str = "untouched";
+    CHECK(!v.tryGet("s", &i) && i == 42);
+    CHECK(!v.tryGet("i", &b) && !b);
+    CHECK(!v.tryGet("b", &str) && strcmp(str, "untouched") == 0);
+    // not an object at all
+    tjson::Value arr;
+    arr.append(1);
+    CHECK(arr.getInt("0", 3) == 3 && arr.getString("0", "def") != NULL);
+    tjson::Value null;
+    CHECK(null.getDouble("k", 0.5) == 0.5 && null.isNull());
+}
+
+TEST(get_copies_the_value_or_the_default)
+{
+    const char *s = "{\"i\":1,\"n\":null}";
+    tjson::Value v;
+    CHECK(tjson::parse(s, strlen(s), &v) == 0);
+    CHECK(v.get("i", 5).asInt() == 1);
+    CHECK(v.get("x", 5).asInt() == 5);
+    CHECK(strcmp(v.get("x", "def").asCString(), "def") == 0);
+    // a present null is not replaced by the default
+    CHECK(v.get("n", 5).isNull());
+}
@@ -0,0 +1,206 @@
+#include "test.h"
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+// xorshift, the same numbers on every run
+static unsigned long long next_random()
+{
+    static unsigned long long x = 88172645463325252ULL;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return x;
+}
+
+static bool same_bits(double a, double b)
+{
+    return memcmp(&a, &b, sizeof(double)) == 0;
+}
+
+struct string_sink : public tjson::Sink
+{
+    void write(const char *s, size_t len) { text.append(s, len); }
+    std::string text;
+};
+
+TEST(doubles_read_back_bit_for_bit)
+{
+    tjson::Writer w;
+    int failed = 0;
+    for (int i = 0; i < 200000 && failed < 5; i++)
+    {
+        unsigned long long bits = next_random();
+        double d;
+        memcpy(&d, &bits, sizeof(d));
+        if (d != d || d - d != 0)
+        {
+            continue;
+        }
+        // read back with strtod, the parser's jsstrtod can be an ulp off
+        // for large exponents
+        const char *s = w.write(tjson::Value(d));
+        if (!same_bits(strtod(s, NULL), d))
+        {
+            printf("%.17g written as %s\n", d, s);
+            failed++;
+        }
+    }
+    CHECK(failed == 0);
+}
+
+TEST(doubles_are_written_short)
+{
+    struct { double d; const char *s; } cases[] =
+    {
+        {0.0, "0.0"}, {-0.0, "-0.0"}, {1, "1.0"}, {-1.5, "-1.5"},
+        {0.1, "0.1"}, {0.3, "0.3"}, {1.0 / 3, "0.3333333333333333"},
+        {1e20, "100000000000000000000.0"}, {1e21, "1e21"}, {1e-6, "0.000001"},
+        {1e-7, "1e-7"}, {5e-324, "5e-324"}, {1.7976931348623157e308, "1.7976931348623157e308"},
+    };
+    tjson::Writer w;
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        CHECK(strcmp(w.write(tjson::Value(cases[i].d)), cases[i].s) == 0);
+    }
+    double zero = 0.0;
+    CHECK(strcmp(w.write(tjson::Value(1 / zero)), "null") == 0);
+    CHECK(strcmp(w.write(tjson::Value(zero / zero)), "null") == 0);
+}
+
+TEST(every_byte_round_trips_through_escaping)
+{
+    std::string all;
+    for (int c = 1; c < 256; c++)
+    {
+        all += (char)c;
+    }
+    tjson::Writer w;
+    for (size_t offset = 0; offset < 20; offset++)
+    {
+        std::string src = std::string(offset, 'a') + all;
+        tjson::Value v;
+        v.set("s", tjson::Value(src.c_str()));
+        size_t len;
+        const char *s = w.write(v, &len);
+        for (size_t i = 0; i < len; i++)
+        {
+            CHECK((unsigned char)s[i] >= 0x20);
+        }
+        tjson::Value back;
+        CHECK(tjson::parse(s, len, &back) == 0);
+        const char *str = NULL;
+        size_t n = 0;
+        CHECK(back.tryGet("s", &str, &n) && n == src.size()
+            && memcmp(str, src.data(), n) == 0);
+    }
+    // a 0 byte inside a string
+    tjson::Value v;
+    CHECK(tjson::parse("\"a\\u0000b\"", 10, &v) == 0);
+    size_t len;
+    const char *s = w.write(v, &len);
+    CHECK(len == 10 && memcmp(s, "\"a\\u0000b\"", 10) == 0);
+    CHECK(strcmp(w.write(tjson::Value("a\"b\\c\n\x01/")), "\"a\\\"b\\\\c\\n\\u0001/\"") == 0);
+}
+
+TEST(streamed_output_matches_the_buffer)
+{
+    std::string big(100000, 'x');
+    big[50000] = '"';
+    tjson::Value v;
+    v.set("k", tjson::Value(big.c_str()));
+    for (int i = 0; i < 5000; i++)
+    {
+        v["arr"].append(tjson::Value(i * 1.5));
+    }
+    tjson::Writer w;
+    size_t len;
+    const char *s = w.write(v, &len);
+    std::string buffered(s, len);
+    string_sink sink;
+    w.write(v, &sink);
+    CHECK(sink.text == buffered);
+    string_sink one;
+    w.write(tjson::Value(1), &one);
+    CHECK(one.text == "1");
+}
+
+static tjson::Value reversed(const tjson::Value &v)
+{
+    tjson::Value r;
+    if (v.isArray())
+    {
+        r.makeArray();
+        for (size_t i = 0; i < v.size(); i++)
+        {
+            r.append(reversed(v[i]));
+        }
+    }
+    else if (v.isObject())
+    {
+        r.makeObject();
+        std::vector<const char *> keys;
+        v.GetKeys(&keys);
+        for (size_t i = keys.size(); i-- > 0;)
+        {
+            r.set(keys[i], reversed(v[keys[i]]));
+        }
+    }
+    else
+    {
+        r = v;
+    }
+    return r;
+}
+
+static const char *TREE = "{\"b\":[1,2.5,{\"z\":null,\"y\":true}],\"a\":\"x\",\"\xc3\xa9\":{},\"c\":[]}";
+
+TEST(canonical_output_ignores_member_order)
+{
+    tjson::Value v;
+    CHECK(tjson::parse(TREE, strlen(TREE), &v) == 0);
+    tjson::Writer w;
+    w.set_canonical(true);
+    std::string a = w.write(v);
+    std::string b = w.write(reversed(v));
+    CHECK(a == b);
+    CHECK(a == "{\"a\":\"x\",\"b\":[1,2.5,{\"y\":true,\"z\":null}],\"c\":[],\"\xc3\xa9\":{}}");
+    CHECK(strcmp(w.write(tjson::Value(2.0)), "2") == 0);
+    CHECK(strcmp(w.write(tjson::Value(-0.0)), "0") == 0);
+}
+
+TEST(pretty_and_streamed_output_read_back_the_same)
+{
+    tjson::Value v;
+    CHECK(tjson::parse(TREE, strlen(TREE), &v) == 0);
+    tjson::Writer w;
+    std::string compact = w.write(v);
+    w.set_indent(2);
+    std::string pretty = w.write(v);
+    CHECK(pretty != compact && pretty.find("\n  \"a\"") != std::string::npos);
+    tjson::Value back;
+    CHECK(tjson::parse(pretty.data(), pretty.size(), &back) == 0);
+    string_sink sink;
+    w.write(v, &sink);
+    CHECK(sink.text == pretty);
+    w.set_indent(0);
+    CHECK(compact == w.write(back));
+}
+
+TEST(canonical_doubles_read_back_the_same)
+{
+    double cases[] = {1e20, -9.3e18, 9007199254740992.0, 9007199254740991.0, -4503599627370496.0, 1e300};
+    tjson::Writer w;
+    w.set_canonical(true);
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        const char *s = w.write(tjson::Value(cases[i]));
+        tjson::Value back;
+        CHECK(tjson::parse(s, strlen(s), &back) == 0);
+        CHECK(back.asDouble() == cases[i]);
+    }
+    CHECK(strcmp(w.write(tjson::Value(1e20)), "1e20") == 0);
+    CHECK(strcmp(w.write(tjson::Value(-9.3e18)), "-9.3e18") == 0);
+    CHECK(strcmp(w.write(tjson::Value(9007199254740991.0)), "9007199254740991") == 0);
+}
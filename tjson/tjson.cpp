@@ -30,18 +30,49 @@
 #include "tjson.h"
 #include <stdlib.h>
 #include <vector>
+#include <algorithm>
 #include <stdint.h>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HAS_SSE2 1
+#include <emmintrin.h>
+#else
+#define HAS_SSE2 0
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sys/mman.h>
+#endif
 
 using namespace tjson;
 using namespace tjson::internal;
 
-#define ARRAY_INIT_SIZE 64
-#define MAP_INIT_SIZE 32
-#define STRING_INIT_SIZE 128
+#define ARRAY_INIT_SIZE 4 // first capacity when containers grow one by one
+#define MAP_INIT_SIZE 4
+#define MAP_INDEX_MIN 16 // objects with this many keys get a hash index
+#define SYNTEX_INIT_SIZE 256
 #define STACK_MAX_SIZE 500
 #define DEBUG_LEX 0
-#define DEBUG_MEM 0
-#define PREALLOC 1
+#ifndef FAST_PARSE
+#define FAST_PARSE 1 // 0 selects the per character state machine parser
+#endif
+#ifndef STRUCTURAL_INDEX
+#define STRUCTURAL_INDEX HAS_SSE2 // index structural characters before parsing
+#endif
+#define INDEX_MIN_SIZE 4096
+#define ARENA_CHUNK_SIZE (16 * 1024)
+#define ARENA_MAX_CHUNK (1024 * 1024)
+#define WRITE_CHUNK_SIZE (16 * 1024) // first writer buffer, and what it streams to a sink in
 
 tjson::Value tjson::Value::Null;
 
@@ -130,12 +161,33 @@ struct parse_score
 
 struct parse_state
 {    
+    parse_state()
+        :syntex_capacity(SYNTEX_INIT_SIZE)
+    {
+        current_syntex = (char*)malloc(SYNTEX_INIT_SIZE);
+        if (!current_syntex)
+        {
+            throw std::bad_alloc();
+        }
+    }
+    ~parse_state()
+    {
+        free(current_syntex);
+    }
     parse_score score;
     size_t score_pos;
     parse_stack<STACK_MAX_SIZE> G;
-    char current_syntex[65536];
+    char *current_syntex;   // token text, always has room for a terminator
+    size_t syntex_capacity;
     size_t syntex_len;
+    const char *syntex_ref; // string token unescaped in place, borrowed by values
+    char *insitu;           // writable source buffer for parse_insitu, or NULL
+    Allocator *alloc;       // where the tree is allocated, NULL for the pool
+    DuplicateKeys dup;
+    KeyTable *keys;         // interns long keys, or NULL
     Value *curval;
+    Value *parents[STACK_MAX_SIZE]; // containers enclosing curval
+    size_t depth;
     syntex_type S;            
     char string_begin;                
 };
@@ -163,6 +215,7 @@ void debug_print(char c)
 static inline void clear_syntex(parse_state *state)
 {
     state->syntex_len = 0;
+    state->syntex_ref = NULL;
 }
 
 static inline void change_syntex(parse_state *state, syntex_type t)
@@ -196,16 +249,187 @@ static inline bool is_symbol(char c)
     return c == ',' || c == ':' || c == '{' || c == '[' || c == ']' || c == '}';
 }
 
+/*
+    wide scanning helpers, 16 or 32 bytes at a time with SSE2/AVX2 and
+    8 bytes at a time in a general register elsewhere
+*/
+
+#if defined(__AVX2__)
+typedef __m256i simd_t;
+#define SIMD_WIDTH 32
+#define SIMD_MASK_ALL 0xFFFFFFFFu
+#define simd_load(p) _mm256_loadu_si256((const __m256i*)(p))
+#define simd_set1(c) _mm256_set1_epi8(c)
+#define simd_or(a, b) _mm256_or_si256(a, b)
+#define simd_eq(v, c) _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c))
+#define simd_mask(v) ((uint32_t)_mm256_movemask_epi8(v))
+#define simd_le(v, c) _mm256_cmpeq_epi8(_mm256_max_epu8(v, _mm256_set1_epi8(c)), _mm256_set1_epi8(c))
+#elif HAS_SSE2
+typedef __m128i simd_t;
+#define SIMD_WIDTH 16
+#define SIMD_MASK_ALL 0xFFFFu
+#define simd_load(p) _mm_loadu_si128((const __m128i*)(p))
+#define simd_set1(c) _mm_set1_epi8(c)
+#define simd_or(a, b) _mm_or_si128(a, b)
+#define simd_eq(v, c) _mm_cmpeq_epi8(v, _mm_set1_epi8(c))
+#define simd_mask(v) ((uint32_t)_mm_movemask_epi8(v))
+#define simd_le(v, c) _mm_cmpeq_epi8(_mm_max_epu8(v, _mm_set1_epi8(c)), _mm_set1_epi8(c)) // unsigned
+#elif defined(_MSC_VER) || (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define SWAR_WIDTH 8
+#endif
+
+static inline int first_bit(uint64_t m)
+{
+#if defined(_MSC_VER) && defined(_WIN64)
+    unsigned long i;
+    _BitScanForward64(&i, m);
+    return (int)i;
+#elif defined(_MSC_VER)
+    unsigned long i;
+    if (_BitScanForward(&i, (unsigned long)m))
+    {
+        return (int)i;
+    }
+    _BitScanForward(&i, (unsigned long)(m >> 32));
+    return (int)i + 32;
+#else
+    return __builtin_ctzll(m);
+#endif
+}
+
+#ifdef SIMD_WIDTH
+static inline uint32_t simd_space_mask(simd_t v)
+{
+    return simd_mask(simd_or(simd_or(simd_eq(v, ' '), simd_eq(v, '\t')),
+                             simd_or(simd_eq(v, '\n'), simd_eq(v, '\r'))));
+}
+#elif defined(SWAR_WIDTH)
+// 0x80 in every byte of x that is zero
+static inline uint64_t swar_zero_bytes(uint64_t x)
+{
+    const uint64_t low7 = 0x7F7F7F7F7F7F7F7FULL;
+    return ~(((x & low7) + low7) | x | low7);
+}
+
+static inline uint64_t swar_byte_mask(uint64_t x, char c)
+{
+    return swar_zero_bytes(x ^ (0x0101010101010101ULL * (unsigned char)c));
+}
+#endif
+
+static const char *skip_space_run(const char *p, const char *end)
+{
+#ifdef SIMD_WIDTH
+    while (end - p >= SIMD_WIDTH)
+    {
+        uint32_t other = simd_space_mask(simd_load(p)) ^ SIMD_MASK_ALL;
+        if (other)
+        {
+            return p + first_bit(other);
+        }
+        p += SIMD_WIDTH;
+    }
+#elif defined(SWAR_WIDTH)
+    while (end - p >= SWAR_WIDTH)
+    {
+        uint64_t x;
+        memcpy(&x, p, sizeof(x));
+        uint64_t space = swar_byte_mask(x, ' ') | swar_byte_mask(x, '\t') |
+                         swar_byte_mask(x, '\n') | swar_byte_mask(x, '\r');
+        uint64_t other = ~space & 0x8080808080808080ULL;
+        if (other)
+        {
+            return p + first_bit(other) / 8;
+        }
+        p += SWAR_WIDTH;
+    }
+#endif
+    while (p < end && is_space(*p))
+    {
+        p++;
+    }
+    return p;
+}
+
+// up to the next quote or backslash, whatever else a string holds is copied
+static inline const char *scan_string_run(const char *p, const char *end, char quote)
+{
+#ifdef SIMD_WIDTH
+    while (end - p >= SIMD_WIDTH)
+    {
+        simd_t v = simd_load(p);
+        uint32_t stop = simd_mask(simd_or(simd_eq(v, quote), simd_eq(v, '\\')));
+        if (stop)
+        {
+            return p + first_bit(stop);
+        }
+        p += SIMD_WIDTH;
+    }
+#elif defined(SWAR_WIDTH)
+    while (end - p >= SWAR_WIDTH)
+    {
+        uint64_t x;
+        memcpy(&x, p, sizeof(x));
+        uint64_t stop = swar_byte_mask(x, quote) | swar_byte_mask(x, '\\');
+        if (stop)
+        {
+            return p + first_bit(stop) / 8;
+        }
+        p += SWAR_WIDTH;
+    }
+#endif
+    while (p < end && *p != quote && *p != '\\')
+    {
+        p++;
+    }
+    return p;
+}
+
+// most gaps between tokens are empty, only go wide on whitespace
+static inline const char *skip_space(const char *p, const char *end)
+{
+    if (p < end && is_space(*p))
+    {
+        return skip_space_run(p + 1, end);
+    }
+    return p;
+}
+
+static void reserve_syntex(size_t n, parse_state *state)
+{
+    size_t need = state->syntex_len + n + 1;
+    size_t new_capacity = state->syntex_capacity * 2;
+    if (new_capacity < need)
+    {
+        new_capacity = need;
+    }
+    char *p = (char*)realloc(state->current_syntex, new_capacity);
+    if (!p)
+    {
+        throw std::bad_alloc();
+    }
+    state->current_syntex = p;
+    state->syntex_capacity = new_capacity;
+}
+
 static inline void append_syntex(char c, parse_state *state)
 {
-    if (state->syntex_len < sizeof(state->current_syntex) - 1)
+    if (state->syntex_len + 1 >= state->syntex_capacity)
     {
-        state->current_syntex[state->syntex_len] = c;
-        state->syntex_len++;
-        return;
+        reserve_syntex(1, state);
     }
+    state->current_syntex[state->syntex_len] = c;
+    state->syntex_len++;
+}
 
-    throw_error(state);
+static inline void append_syntex(const char *s, size_t n, parse_state *state)
+{
+    if (state->syntex_len + n >= state->syntex_capacity)
+    {
+        reserve_syntex(n, state);
+    }
+    memcpy(state->current_syntex + state->syntex_len, s, n);
+    state->syntex_len += n;
 }
 
 static inline bool match_symbol(char c, char expect)
@@ -213,10 +437,38 @@ static inline bool match_symbol(char c, char expect)
     return c == expect;
 }
 
+// values keep no link to their container, the parser remembers the way up
+static inline void enter_value(parse_state *state, Value *v)
+{
+    if (state->depth >= STACK_MAX_SIZE)
+    {
+        throw_error(state);
+    }
+    state->parents[state->depth++] = state->curval;
+    state->curval = v;
+}
+
+static inline void leave_value(parse_state *state)
+{
+    state->curval = state->depth ? state->parents[--state->depth] : NULL;
+}
+
+static inline void build_syntex_string(parse_state *state, Value *v)
+{
+    if (state->syntex_ref)
+    {
+        v->internal_build_string(state->syntex_ref, state->syntex_len, true, state->alloc);
+    }
+    else
+    {
+        v->internal_build_string(state->current_syntex, state->syntex_len, false, state->alloc);
+    }
+}
+
 static inline void match_string(parse_state *state)
 {
     state->G.pop();
-    state->curval->internal_build_string(state->current_syntex, state->syntex_len);
+    build_syntex_string(state, state->curval);
 }
 
 static inline void match_number(parse_state *state)
@@ -236,13 +488,13 @@ static inline void match_float(parse_state *state)
 static inline void match_dict(parse_state *state)
 {
     state->G.top() = G_KEY;
-    state->curval->internal_build_object();
+    state->curval->internal_build_object(state->alloc);
 }
 
 static inline void match_array(parse_state *state)
 {
     state->G.top() = G_ELEMENT;
-    state->curval->internal_build_array();
+    state->curval->internal_build_array(state->alloc);
 }
 
 static inline void match_element_number(parse_state *state)
@@ -268,7 +520,7 @@ static inline void match_element_string(parse_state *state)
     state->G.top() = G_ARRAYSEP;
     Value *element = state->curval->internal_add();
     assert(element);
-    element->internal_build_string(state->current_syntex, state->syntex_len);
+    build_syntex_string(state, element);
 }
 
 static inline void match_element_dict(parse_state *state)
@@ -277,9 +529,8 @@ static inline void match_element_dict(parse_state *state)
     state->G.push(G_KEY);
     Value *element = state->curval->internal_add();
     assert(element);
-    element->internal_build_object();
-    element->internal_parent = state->curval;
-    state->curval = element;
+    element->internal_build_object(state->alloc);
+    enter_value(state, element);
     assert(state->curval);
 }
 
@@ -289,9 +540,8 @@ static inline void match_element_array(parse_state *state)
     state->G.push(G_ELEMENT);
     Value *element = state->curval->internal_add();
     assert(element);
-    element->internal_build_array();
-    element->internal_parent = state->curval;
-    state->curval = element;
+    element->internal_build_array(state->alloc);
+    enter_value(state, element);
     assert(state->curval);
 }
 
@@ -317,7 +567,7 @@ static inline void match_value_number(parse_state *state)
     state->G.top() = G_DICTSEP;
     state->current_syntex[state->syntex_len]= 0;
     state->curval->internal_build_integer(state->current_syntex);
-    state->curval = state->curval->internal_parent;
+    leave_value(state);
     assert(state->curval);
 }
 
@@ -326,7 +576,7 @@ static inline void match_value_float(parse_state *state)
     state->G.top() = G_DICTSEP;
     state->current_syntex[state->syntex_len]= 0;
     state->curval->internal_build_float(state->current_syntex);
-    state->curval = state->curval->internal_parent;
+    leave_value(state);
     assert(state->curval);
 }
 
@@ -334,7 +584,7 @@ static inline void match_value_null(parse_state *state)
 {
     state->G.top() = G_DICTSEP;
     state->current_syntex[state->syntex_len]= 0;
-    state->curval = state->curval->internal_parent;
+    leave_value(state);
     assert(state->curval);
 }
 
@@ -343,15 +593,15 @@ static inline void match_value_bool(parse_state *state, bool v)
     state->G.top() = G_DICTSEP;
     state->current_syntex[state->syntex_len]= 0;
     state->curval->internal_build_bool(v);
-    state->curval = state->curval->internal_parent;
+    leave_value(state);
     assert(state->curval);
 }
 
 static inline void match_value_string(parse_state *state)
 {
     state->G.top() = G_DICTSEP;
-    state->curval->internal_build_string(state->current_syntex, state->syntex_len);
-    state->curval = state->curval->internal_parent;
+    build_syntex_string(state, state->curval);
+    leave_value(state);
     assert(state->curval);
 }
 
@@ -359,36 +609,47 @@ static inline void match_value_dict(parse_state *state)
 {
     state->G.top() = G_DICTSEP;
     state->G.push(G_KEY);
-    state->curval->internal_build_object();
+    state->curval->internal_build_object(state->alloc);
 }
 
 static inline void match_value_array(parse_state *state)
 {
     state->G.top() = G_DICTSEP;
     state->G.push(G_ELEMENT);
-    state->curval->internal_build_array();
+    state->curval->internal_build_array(state->alloc);
 }
 
 static inline void match_array_end(parse_state *state)
 {
     state->G.pop();
-    state->curval = state->curval->internal_parent; 
+    leave_value(state);
 }
 
 static inline void match_dict_end(parse_state *state)
 {
     state->G.pop();
-    state->curval = state->curval->internal_parent;
+    state->curval->internal_end_object(state->dup);
+    leave_value(state);
 }
 
 
 static inline void match_key(parse_state *state)
 {
     state->G.top() = G_KEYSEP;
-    Value *new_value = state->curval->internal_add_key(state->current_syntex, state->syntex_len);
-    assert(new_value);
-    new_value->internal_parent = state->curval;
-    state->curval = new_value;
+    Value *new_value;
+    if (state->syntex_ref)
+    {
+        new_value = state->curval->internal_add_key(state->syntex_ref, state->syntex_len, true, state->dup, state->keys);
+    }
+    else
+    {
+        new_value = state->curval->internal_add_key(state->current_syntex, state->syntex_len, false, state->dup, state->keys);
+    }
+    if (!new_value)
+    {
+        throw_error(state);
+    }
+    enter_value(state, new_value);
 }
 
 static void get_word(parse_state *state)
@@ -625,46 +886,10 @@ static inline void jump_space(parse_state *state)
     change_syntex(state, S_SPACE_END);
     parse_score &score = state->score;
     size_t &i = state->score_pos;
-#ifdef _MSC_VER
-    while (i < score.size - 32)
-    {
-        const char *space32 = "                                ";
-        if (memcmp(score.buff+i, space32, 32) != 0)
-        {
-            break;
-        }
-        i += 32;
-    }
-    while (i < score.size - 16)
-    {
-        const char *space16 = "                ";
-        if (memcmp(score.buff+i, space16, 16) != 0)
-        {
-            break;
-        }
-        i += 16;
-    }
-    while (i < score.size - 8)
-    {
-        const char *space8 = "        ";
-        if (memcmp(score.buff+i, space8, 8) != 0)
-        {
-            break;
-        }
-        i += 8;
-    }
-    while (i < score.size - 4)
+    if (i < score.size)
     {
-        const char *space4 = "    ";
-        if (memcmp(score.buff+i, space4, 4) != 0)
-        {
-            break;
-        }
-        i += 4;
+        i = skip_space(score.buff + i, score.buff + score.size) - score.buff;
     }
-#endif
-    while(is_space(score[i++]));
-    state->score_pos--;
 }
 
 static void proc_word(parse_state *state)
@@ -931,32 +1156,37 @@ static void proc_symbol(parse_state *state)
     }
 }
 
-static void codePointToUTF8(parse_state *state, unsigned int cp)
+static size_t codePointToUTF8(char *out, unsigned int cp)
 {
     // based on description from http://en.wikipedia.org/wiki/UTF-8
 
     if (cp <= 0x7f) 
     {
-        append_syntex(static_cast<char>(cp), state);
+        out[0] = static_cast<char>(cp);
+        return 1;
     } 
     else if (cp <= 0x7FF) 
     {
-        append_syntex(static_cast<char>(0xC0 | (0x1f & (cp >> 6))), state);
-        append_syntex(static_cast<char>(0x80 | (0x3f & cp)), state);
+        out[0] = static_cast<char>(0xC0 | (0x1f & (cp >> 6)));
+        out[1] = static_cast<char>(0x80 | (0x3f & cp));
+        return 2;
     } 
     else if (cp <= 0xFFFF) 
     {
-        append_syntex(0xE0 | static_cast<char>((0xf & (cp >> 12))), state);
-        append_syntex(0x80 | static_cast<char>((0x3f & (cp >> 6))), state);
-        append_syntex(static_cast<char>(0x80 | (0x3f & cp)), state);                
+        out[0] = static_cast<char>(0xE0 | (0xf & (cp >> 12)));
+        out[1] = static_cast<char>(0x80 | (0x3f & (cp >> 6)));
+        out[2] = static_cast<char>(0x80 | (0x3f & cp));
+        return 3;
     }
     else if (cp <= 0x10FFFF) 
     {
-        append_syntex(static_cast<char>(0xF0 | (0x7 & (cp >> 18))), state);  
-        append_syntex(static_cast<char>(0x80 | (0x3f & (cp >> 12))), state);  
-        append_syntex(static_cast<char>(0x80 | (0x3f & (cp >> 6))), state); 
-        append_syntex(static_cast<char>(0x80 | (0x3f & cp)), state); 
+        out[0] = static_cast<char>(0xF0 | (0x7 & (cp >> 18)));
+        out[1] = static_cast<char>(0x80 | (0x3f & (cp >> 12)));
+        out[2] = static_cast<char>(0x80 | (0x3f & (cp >> 6)));
+        out[3] = static_cast<char>(0x80 | (0x3f & cp));
+        return 4;
     }
+    return 0;
 }
 
 static void decodeUnicodeEscapeSequence(parse_state *state, 
@@ -1017,62 +1247,113 @@ static void proc_string(parse_state *state)
 {
     parse_score &score = state->score;
     size_t &i = state->score_pos;
-    char c = score[i++];
+    // in place the unescaped text never outruns the source, so it is
+    // written back over the bytes already consumed
+    char *out = state->insitu ? state->insitu + i : NULL;
+    char *out_begin = out;
+    char c;
 
-    while (c != state->string_begin)
+    for (;;)
     {
-        if (c == '\\')
+        // everything up to the next quote or backslash is taken as is
+        const char *run = score.buff + i;
+        size_t n = scan_string_run(run, score.buff + score.size, state->string_begin) - run;
+        if (out)
         {
-            c = score[i++];
-            if (c == 't')
-            {
-                c = '\t';
-            }
-            else if (c == 'n')
-            {
-                c = '\n';
-            }
-            else if (c == 'r')
-            {
-                c = '\r';
-            }
-            else if (c == '\'')
-            {
-                c = '\'';
-            }
-            else if (c == '\"')
-            {
-                c = '\"';
-            }
-            else if (c == '\\')
-            {
-                c = '\\';
-            }
-            else if (c == 'b')
-            {
-                c = '\b';
-            }
-            else if (c == 'f')
-            {
-                c = '\f';
-            }
-            else if (c == '/')
-            {
-                c = '/';
-            }
-            else if (c == 'u' && state->score.size - 1 > 4)
+            memmove(out, run, n);
+            out += n;
+        }
+        else
+        {
+            append_syntex(run, n, state);
+        }
+        i += n;
+
+        c = score[i++];
+        if (c == state->string_begin)
+        {
+            break;
+        }
+        if (i > score.size)
+        {
+            throw_error(state);
+        }
+
+        // c is a backslash
+        c = score[i++];
+        if (c == 't')
+        {
+            c = '\t';
+        }
+        else if (c == 'n')
+        {
+            c = '\n';
+        }
+        else if (c == 'r')
+        {
+            c = '\r';
+        }
+        else if (c == '\'')
+        {
+            c = '\'';
+        }
+        else if (c == '\"')
+        {
+            c = '\"';
+        }
+        else if (c == '\\')
+        {
+            c = '\\';
+        }
+        else if (c == 'b')
+        {
+            c = '\b';
+        }
+        else if (c == 'f')
+        {
+            c = '\f';
+        }
+        else if (c == '/')
+        {
+            c = '/';
+        }
+        else if (c == 'u' && state->score.size - 1 > 4)
+        {
+            unsigned int unicode = 0;
+            decodeUnicodeCodePoint( state, unicode );
+            char utf8[4];
+            size_t n = codePointToUTF8(utf8, unicode);
+            if (out)
             {
-                unsigned int unicode = 0;
-                decodeUnicodeCodePoint( state, unicode );
-                codePointToUTF8(state, unicode);
+                memcpy(out, utf8, n);
+                out += n;
             }
             else
             {
-                throw_error(state);
+                append_syntex(utf8, n, state);
             }
+            continue;
         }
-        append_syntex(c, state);
-        c = score[i++];
+        else
+        {
+            throw_error(state);
+        }
+
+        if (out)
+        {
+            *out++ = c;
+        }
+        else
+        {
+            append_syntex(c, state);
+        }
+    }
+
+    if (out)
+    {
+        *out = 0;
+        state->syntex_ref = out_begin;
+        state->syntex_len = out - out_begin;
     }
 
     c = score[i++];
@@ -1095,15 +1376,22 @@ static void proc_string(parse_state *state)
     }
 }
 
-static void _parse(const char *score, size_t len, Value *root)
+static void legacy_parse(const char *score, size_t len, Value *root, char *insitu, Allocator *alloc, DuplicateKeys dup, KeyTable *keys)
 {
-    parse_state *state = new parse_state;
+    parse_state parser;
+    parse_state *state = &parser;
     state->S = S_START;
     state->score_pos = 0;
     state->syntex_len = 0;
+    state->syntex_ref = NULL;
+    state->insitu = insitu;
+    state->alloc = alloc;
+    state->dup = dup;
+    state->keys = keys;
     state->score.buff = score;
     state->score.size = len;
     state->curval = root;
+    state->depth = 0;
     state->G.push(G_START);
     state->G.state = state;
     proc_start(state);
@@ -1146,458 +1434,3986 @@ static void _parse(const char *score, size_t len, Value *root)
     }
 }
 
-size_t tjson::parse(const char *s, size_t len, Value *root)
+/*
+    fast engine: works on the raw byte range one token at a time. Every value
+    is dispatched once on its first byte, bare tokens and strings are scanned
+    with a character class table, and open containers are kept on an explicit
+    stack instead of being tracked through the per character state machine.
+*/
+
+enum char_class_type
 {
-    try {
-        _parse(s, len, root);
-        return 0;
-    } catch(tjException &ex) {
-        return ex.pos;
-    }    
-}
+    C_SPACE  = 1,
+    C_SYMBOL = 2,
+    C_DIGIT  = 4,
+    C_QUOTE  = 8,
+};
 
+#define SP C_SPACE
+#define SY C_SYMBOL
+#define DG C_DIGIT
+#define QT C_QUOTE
+static const unsigned char char_class[256] = 
+{
+    0, 0, 0, 0, 0, 0, 0, 0, 0, SP, SP, 0, 0, SP, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    SP, 0, QT, 0, 0, 0, 0, QT, 0, 0, 0, 0, SY, 0, 0, 0,
+    DG, DG, DG, DG, DG, DG, DG, DG, DG, DG, SY, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, SY, 0, SY, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, SY, 0, SY, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+#undef SP
+#undef SY
+#undef DG
+#undef QT
 
-#if PREALLOC
-#define mempool_init_count 191
-#define pool_init_size 0
-#define pool_increase 1
-#else
-#define mempool_init_count 0
-#define pool_init_size 0
-#define pool_increase 1
-#endif
+#define NO_INDEX ((size_t)-1)
 
-#define align_size 8
-#define mem_align(d) (((d) + (align_size - 1)) & ~(align_size - 1))
-static std::vector<std::vector<void *> > g_mem_list;
-#if DEBUG_MEM
-static std::vector<size_t> g_memdgb_list;
-#endif
-#if PREALLOC
-#ifdef _MSC_VER
-static const int memsizetable[] = {1,1336, 4,2669, 15,1386, 16,88, 17,86, 18,86, 19,54, 20,26, 21,4, 22,2, 159,435, 191,502};
-#else
-static const int memsizetable[] = {1,1336, 4,2669, 15,1386, 16,88, 17,86, 18,86, 19,54, 20,26, 21,4, 22,2, 159,435, 191,502};
-#endif
-#else
-static const int memsizetable[2] = {-1,-1};
-#endif
-static int findmemtable(size_t idx)
+// an open container: where its own value sits and where its children start
+struct scan_frame
 {
-    for (int i = 0; i < (int)(sizeof(memsizetable) / sizeof(int)); i += 2)
-    {
-        if ((int)idx == memsizetable[i])
-        {
-            return memsizetable[i+1];
-        }        
-    }
-    return -1;
-}
+    size_t index;       // in scan_state::values, NO_INDEX for the root
+    size_t first_value;
+    size_t first_key;
+    size_t count;       // children so far, for handlers
+    bool array;
+};
 
-static struct mem_pool_init_util
+// what a pushed document expects next, see Parser::feed
+enum push_expect
 {
-    static void init_pool(size_t poolidx, size_t addsize)
-    {
-        for (size_t i = 0; i < addsize; i++)
-        {
-            g_mem_list[poolidx].push_back(malloc(align_size * (poolidx+1)));
-        }
-    }
-    mem_pool_init_util()
+    PX_VALUE,
+    PX_ELEMENT,     // a value or the ']' after '[' or ','
+    PX_MEMBER,      // a key or the '}' after '{' or ','
+    PX_COLON,
+    PX_NEXT,        // ',' or a closing bracket, only space after the root
+};
+
+/*
+    children of open containers are collected on the values and keys stacks
+    and moved into a block of exactly the right size when the container
+    closes, values are relocated with memcpy like everywhere else
+*/
+struct tjson::internal::scan_state
+{
+    scan_state()
+        :begin(NULL),end(NULL),base(0),insitu(NULL),alloc(NULL),dup(JD_LAST_WINS),key_table(NULL)
+        ,values(NULL),nvalues(0),values_capacity(0)
+        ,keys(NULL),nkeys(0),keys_capacity(0)
+        ,index(NULL),index_capacity(0)
+        ,expect(PX_NEXT),root(NULL),handler(NULL),escaped(false),carry_at(0),fed(0),error(0){}
+    ~scan_state()
     {
-        g_mem_list.resize(mempool_init_count);
-#if DEBUG_MEM
-        g_memdgb_list.resize(mempool_init_count);
-#endif
-        for (size_t i = 1; i <= mempool_init_count; i++)
-        {            
-            init_pool(i-1, (findmemtable(i-1) != -1)?findmemtable(i-1):pool_init_size);
-        }
+        release();
+        free(values);
+        free(keys);
+        free(index);
     }
-
-    ~mem_pool_init_util()
+    // drops whatever an aborted parse left on the stacks
+    void release()
     {
-        for (size_t i = 0; i < g_mem_list.size(); i++)
+        for (size_t i = 0; i < nvalues; i++)
         {
-            if (g_mem_list[i].size() != 0)
-            {
-#if DEBUG_MEM
-                printf("%lu,%lu, ", i, g_mem_list[i].size());
-#endif
-                for (std::vector<void*>::iterator it = g_mem_list[i].begin();
-                    it != g_mem_list[i].end(); ++it)
-                {
-                    free(*it);
-                }
-            }             
+            values[i].~Value();
         }
-
-#if DEBUG_MEM
-        for (size_t i = 0; i < g_memdgb_list.size(); i++)
+        for (size_t i = 0; i < nkeys; i++)
         {
-            if (g_memdgb_list[i] != 0)
-            {
-                printf("leak %lu %lu\n", i, g_memdgb_list[i]);
-            }            
+            keys[i].~Value();
         }
-#endif
+        nvalues = 0;
+        nkeys = 0;
+        stack.clear();
+        carry.clear();
     }
-}g_initutil;
+    const char *begin;
+    const char *end;
+    size_t base;                  // offset of begin in a pushed document
+    char *insitu;                 // writable source for parse_insitu, or NULL
+    Allocator *alloc;             // where the tree is allocated, NULL for the pool
+    DuplicateKeys dup;
+    KeyTable *key_table;          // interns long keys, or NULL
+    std::vector<scan_frame> stack; // open containers, innermost last
+    Value *values;
+    size_t nvalues;
+    size_t values_capacity;
+    Value *keys;                  // string values, one per open object member
+    size_t nkeys;
+    size_t keys_capacity;
+    std::vector<size_t> key_offsets; // where each stacked key starts, JD_ERROR only
+    std::vector<char> scratch;    // unescaped strings when not in place
+    uint32_t *index;              // token start offsets, see build_structural_index
+    size_t index_capacity;
+    push_expect expect;           // the rest is only used when pushing
+    Value *root;                  // where the tree goes, or NULL for handler
+    Handler *handler;
+    std::vector<char> carry;      // a token split between pieces
+    bool escaped;                 // carry ends inside an escape
+    size_t carry_at;
+    size_t fed;                   // bytes before the current piece
+    size_t error;
+};
 
-void *tjson::internal::jsmalloc( size_t s )
+template <class T>
+static T *grow_stack(T *buff, size_t &capacity)
 {
-    size_t pool_idx = mem_align(s) / align_size - 1;    
-    if (pool_idx >= g_mem_list.size())
+    size_t n = capacity ? capacity * 2 : 64;
+    T *p = (T*)realloc((void*)buff, n * sizeof(T));
+    if (!p)
     {
-        g_mem_list.resize(pool_idx + 1);    
-#if DEBUG_MEM
-        g_memdgb_list.resize(pool_idx + 1);
+        throw std::bad_alloc();
+    }
+    capacity = n;
+    return p;
+}
+
+static inline Value *push_value(scan_state *state)
+{
+    if (state->nvalues == state->values_capacity)
+    {
+        state->values = grow_stack(state->values, state->values_capacity);
+    }
+    return ::new(&state->values[state->nvalues++]) Value;
+}
+
+static inline void push_key(scan_state *state, const char *k, size_t len, bool borrow)
+{
+    if (state->nkeys == state->keys_capacity)
+    {
+        state->keys = grow_stack(state->keys, state->keys_capacity);
+    }
+    Value *key = ::new(&state->keys[state->nkeys]) Value;
+    state->nkeys++;
+    key->internal_build_key(k, len, borrow, state->alloc, state->key_table);
+}
+
+static void scan_error(scan_state *state, const char *p)
+{
+    throw tjException(state->base + (p - state->begin) + 1);
+}
+
+static inline bool is_class(char c, int cls)
+{
+    return (char_class[(unsigned char)c] & cls) != 0;
+}
+
+static inline const char *scan_token(const char *p, const char *end)
+{
+    while (p < end && !is_class(*p, C_SPACE | C_SYMBOL))
+    {
+        p++;
+    }
+    return p;
+}
+
+static inline int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+static const char *scan_unicode_escape(scan_state *state, const char *p, unsigned int &unicode)
+{
+    if (state->end - p < 4)
+    {
+        scan_error(state, p);
+    }
+    unicode = 0;
+    for (int index = 0; index < 4; index++)
+    {
+        int h = hex_value(p[index]);
+        if (h < 0)
+        {
+            scan_error(state, p + index);
+        }
+        unicode = unicode * 16 + h;
+    }
+    return p + 4;
+}
+
+// make room for n more bytes of unescaped output
+static inline char *reserve_unescaped(scan_state *state, char *out, size_t len, size_t n)
+{
+    if (state->insitu)
+    {
+        return out;
+    }
+    if (len + n > state->scratch.size())
+    {
+        state->scratch.resize((len + n) * 2);
+    }
+    return &state->scratch[0];
+}
+
+// p is on the opening quote, returns the position after the closing one
+static const char *scan_string(scan_state *state, const char *p, 
+                               const char *&s, size_t &len, bool &borrow)
+{
+    const char *end = state->end;
+    char quote = *p++;
+    const char *start = p;
+
+    p = scan_string_run(p, end, quote);
+    if (p >= end)
+    {
+        scan_error(state, p);
+    }
+
+    borrow = state->insitu != NULL;
+    if (*p == quote)
+    {
+        // nothing to unescape, use the source bytes as they are
+        s = start;
+        len = p - start;
+        if (borrow)
+        {
+            state->insitu[p - state->begin] = 0;
+        }
+        return p + 1;
+    }
+
+    // in place the unescaped text never outruns the source, so it is
+    // written back over the bytes already consumed
+    char *out = borrow ? state->insitu + (start - state->begin) : NULL;
+    size_t olen = 0;
+    const char *run = start;
+    for (;;)
+    {
+        out = reserve_unescaped(state, out, olen, p - run + 4);
+        memmove(out + olen, run, p - run);
+        olen += p - run;
+        if (*p == quote)
+        {
+            break;
+        }
+
+        // escape sequence
+        if (++p >= end)
+        {
+            scan_error(state, p);
+        }
+        char c = *p++;
+        switch (c)
+        {
+        case 't': out[olen++] = '\t'; break;
+        case 'n': out[olen++] = '\n'; break;
+        case 'r': out[olen++] = '\r'; break;
+        case 'b': out[olen++] = '\b'; break;
+        case 'f': out[olen++] = '\f'; break;
+        case '\'':
+        case '\"':
+        case '\\':
+        case '/':
+            out[olen++] = c;
+            break;
+        case 'u':
+            {
+                unsigned int unicode;
+                p = scan_unicode_escape(state, p, unicode);
+                if (unicode >= 0xD800 && unicode <= 0xDBFF)
+                {
+                    // surrogate pairs
+                    unsigned int surrogatePair;
+                    if (end - p < 6 || p[0] != '\\' || p[1] != 'u')
+                    {
+                        scan_error(state, p);
+                    }
+                    p = scan_unicode_escape(state, p + 2, surrogatePair);
+                    unicode = 0x10000 + ((unicode & 0x3FF) << 10) + (surrogatePair & 0x3FF);
+                }
+                olen += codePointToUTF8(out + olen, unicode);
+            }
+            break;
+        default:
+            scan_error(state, p - 1);
+        }
+
+        run = p;
+        p = scan_string_run(p, end, quote);
+        if (p >= end)
+        {
+            scan_error(state, p);
+        }
+    }
+
+    if (borrow)
+    {
+        out[olen] = 0;
+    }
+    s = out;
+    len = olen;
+    return p + 1;
+}
+
+/*
+    structural index: a first pass classifies the input 64 bytes at a time
+    into bitmaps of quotes, backslashes, whitespace and structural characters,
+    masks out string interiors and records the offset of every token start
+    (structural characters, opening quotes and the first byte of bare tokens).
+    fast_parse then jumps from token to token instead of skipping whitespace.
+*/
+
+struct block_masks
+{
+    uint64_t backslash;
+    uint64_t quote;
+    uint64_t squote;
+    uint64_t op;
+    uint64_t space;
+};
+
+static inline void classify_block(const char *p, block_masks &m)
+{
+    m.backslash = m.quote = m.squote = m.op = m.space = 0;
+#ifdef SIMD_WIDTH
+    for (int lane = 0; lane < 64; lane += SIMD_WIDTH)
+    {
+        simd_t v = simd_load(p + lane);
+        // '[' and ']' become '{' and '}' once bit 5 is set
+        simd_t folded = simd_or(v, simd_set1(0x20));
+        m.backslash |= (uint64_t)simd_mask(simd_eq(v, '\\')) << lane;
+        m.quote |= (uint64_t)simd_mask(simd_eq(v, '\"')) << lane;
+        m.squote |= (uint64_t)simd_mask(simd_eq(v, '\'')) << lane;
+        m.op |= (uint64_t)simd_mask(simd_or(simd_or(simd_eq(folded, '{'), simd_eq(folded, '}')),
+                                            simd_or(simd_eq(v, ':'), simd_eq(v, ',')))) << lane;
+        m.space |= (uint64_t)simd_space_mask(v) << lane;
+    }
+#else
+    for (int i = 0; i < 64; i++)
+    {
+        uint64_t bit = (uint64_t)1 << i;
+        char c = p[i];
+        if (c == '\\')
+            m.backslash |= bit;
+        else if (c == '\"')
+            m.quote |= bit;
+        else if (c == '\'')
+            m.squote |= bit;
+        else if (is_class(c, C_SYMBOL))
+            m.op |= bit;
+        else if (is_class(c, C_SPACE))
+            m.space |= bit;
+    }
 #endif
+}
+
+// characters escaped by an odd run of backslashes, carrying across blocks
+static inline uint64_t find_escaped(uint64_t backslash, uint64_t &prev_escaped)
+{
+    const uint64_t even_bits = 0x5555555555555555ULL;
+    backslash &= ~prev_escaped;
+    uint64_t follows_escape = (backslash << 1) | prev_escaped;
+    uint64_t odd_starts = backslash & ~even_bits & ~follows_escape;
+    uint64_t even_sequences = odd_starts + backslash;
+    prev_escaped = even_sequences < odd_starts ? 1 : 0;
+    uint64_t invert_mask = even_sequences << 1;
+    return (even_bits ^ invert_mask) & follows_escape;
+}
+
+// bit i set when an odd number of bits at or below i are set
+static inline uint64_t prefix_xor(uint64_t m)
+{
+    m ^= m << 1;
+    m ^= m << 2;
+    m ^= m << 4;
+    m ^= m << 8;
+    m ^= m << 16;
+    m ^= m << 32;
+    return m;
+}
+
+// returns false when the input uses something the index can not follow:
+// single quoted strings, backslashes or quotes inside bare tokens, or an
+// unterminated string. The plain scanner handles (or reports) those.
+static bool build_structural_index(scan_state *state)
+{
+    const char *buf = state->begin;
+    size_t len = state->end - state->begin;
+    size_t n = 0;
+    uint64_t prev_escaped = 0;
+    uint64_t prev_in_string = 0;
+    uint64_t prev_scalar = 0;
+    char tail[64];
+
+    if (len >= 0xFFFFFFFF)
+    {
+        return false;
+    }
+
+    for (size_t base = 0; base < len; base += 64)
+    {
+        const char *p = buf + base;
+        if (len - base < 64)
+        {
+            memset(tail, ' ', sizeof(tail));
+            memcpy(tail, p, len - base);
+            p = tail;
+        }
+
+        block_masks m;
+        classify_block(p, m);
+
+        uint64_t quote = m.quote & ~find_escaped(m.backslash, prev_escaped);
+        // from the opening quote up to, not including, the closing one
+        uint64_t in_string = prefix_xor(quote) ^ prev_in_string;
+        prev_in_string = (uint64_t)((int64_t)in_string >> 63);
+
+        uint64_t scalar = ~(m.op | m.space);
+        uint64_t nonquote_scalar = scalar & ~quote;
+        uint64_t follows_scalar = (nonquote_scalar << 1) | prev_scalar;
+        prev_scalar = nonquote_scalar >> 63;
+
+        if (((m.squote | m.backslash) & ~in_string) || (quote & in_string & follows_scalar))
+        {
+            return false;
+        }
+
+        uint64_t string_tail = in_string ^ quote;
+        uint64_t starts = (m.op | (scalar & ~follows_scalar)) & ~string_tail;
+
+        if (n + 65 > state->index_capacity)
+        {
+            // one token per 8 bytes is typical, grow from there
+            size_t new_capacity = state->index_capacity * 2 + len / 8 + 65;
+            uint32_t *new_index = (uint32_t*)realloc(state->index, new_capacity * sizeof(uint32_t));
+            if (!new_index)
+            {
+                return false;
+            }
+            state->index = new_index;
+            state->index_capacity = new_capacity;
+        }
+        uint32_t *index = state->index;
+        while (starts)
+        {
+            index[n++] = (uint32_t)(base + first_bit(starts));
+            starts &= starts - 1;
+        }
+    }
+
+    if (prev_in_string || !state->index)
+    {
+        return false;
+    }
+    state->index[n] = (uint32_t)len; // sentinel, every lookup stops here
+    return true;
+}
+
+struct plain_cursor
+{
+    plain_cursor(scan_state *) {}
+    const char *next(const char *p, const char *end)
+    {
+        return skip_space(p, end);
+    }
+};
+
+struct indexed_cursor
+{
+    indexed_cursor(scan_state *state)
+        :begin(state->begin),pos(state->index){}
+    const char *next(const char *p, const char *)
+    {
+        uint32_t i = (uint32_t)(p - begin);
+        while (*pos < i)
+        {
+            pos++;
+        }
+        return begin + *pos;
+    }
+    const char *begin;
+    const uint32_t *pos;
+};
+
+enum number_type
+{
+    N_NONE,
+    N_INTEGER,
+    N_FLOAT,
+};
+
+static number_type scan_number(const char *p, const char *end)
+{
+    bool is_float = false;
+    size_t digits = 0;
+    if (p < end && *p == '-')
+    {
+        p++;
+    }
+    for (; p < end && is_digit(*p); p++)
+    {
+        digits++;
+    }
+    if (p < end && *p == '.')
+    {
+        is_float = true;
+        for (p++; p < end && is_digit(*p); p++)
+        {
+            digits++;
+        }
+    }
+    if (digits == 0)
+    {
+        return N_NONE;
+    }
+    if (p < end && (*p == 'e' || *p == 'E'))
+    {
+        is_float = true;
+        p++;
+        if (p < end && (*p == '-' || *p == '+'))
+        {
+            p++;
+        }
+        if (p >= end || !is_digit(*p))
+        {
+            return N_NONE;
+        }
+        while (p < end && is_digit(*p))
+        {
+            p++;
+        }
+    }
+    if (p != end)
+    {
+        return N_NONE;
+    }
+    return is_float ? N_FLOAT : N_INTEGER;
+}
+
+static double jsstrtod(const char *string, char **endPtr);
+static int64_t fs2i(const char* str);
+
+enum scalar_type
+{
+    SC_NULL,
+    SC_TRUE,
+    SC_FALSE,
+    SC_INTEGER,
+    SC_FLOAT,
+    SC_WORD,
+};
+
+// what the literal, number or bare word in [s, e) is. Numbers are handed
+// back 0 terminated in num for the converters, copied into local when
+// they fit
+static scalar_type read_scalar(scan_state *state, const char *s, const char *e, char (&local)[64], const char *&num)
+{
+    size_t len = e - s;
+    if (len == 4 && memcmp(s, "null", 4) == 0)
+    {
+        return SC_NULL;
+    }
+    if (len == 4 && memcmp(s, "true", 4) == 0)
+    {
+        return SC_TRUE;
+    }
+    if (len == 5 && memcmp(s, "false", 5) == 0)
+    {
+        return SC_FALSE;
+    }
+
+    number_type t = scan_number(s, e);
+    if (t == N_NONE)
+    {
+        if (state->stack.empty())
+        {
+            scan_error(state, s);
+        }
+        return SC_WORD;
+    }
+
+    char *buff = local;
+    if (len >= sizeof(local))
+    {
+        state->scratch.resize(len + 1);
+        buff = &state->scratch[0];
+    }
+    memcpy(buff, s, len);
+    buff[len] = 0;
+    num = buff;
+    return t == N_INTEGER ? SC_INTEGER : SC_FLOAT;
+}
+
+/*
+    fast_parse reports what it reads to an EVENTS object, which either
+    builds the tree (dom_builder) or passes it on to a Handler
+    (sax_events). A false return stops the parse with an error
+*/
+
+struct dom_builder
+{
+    dom_builder(scan_state *_state, Value *_root)
+        :state(_state),root(_root),v(_root){}
+    bool open(scan_frame &f)
+    {
+        f.index = v == root ? NO_INDEX : v - state->values;
+        f.first_value = state->nvalues;
+        f.first_key = state->nkeys;
+        return true;
+    }
+    // the container gets its type and children when it closes
+    bool close(const scan_frame &f)
+    {
+        Value *c = f.index == NO_INDEX ? root : &state->values[f.index];
+        size_t n = state->nvalues - f.first_value;
+        size_t taken = n;
+        if (f.array)
+        {
+            c->internal_take_array(state->values + f.first_value, n, state->alloc);
+        }
+        else
+        {
+            taken = c->internal_take_object(state->keys + f.first_key, state->values + f.first_value, n, state->alloc, state->dup);
+        }
+        state->nvalues = f.first_value;
+        state->nkeys = f.first_key;
+        if (taken < n)
+        {
+            throw tjException(state->key_offsets[f.first_key + taken] + 1);
+        }
+        return true;
+    }
+    void element()
+    {
+        v = push_value(state);
+    }
+    // at is where the key starts in the source
+    bool key(const char *at, const char *k, size_t len, bool borrow)
+    {
+        if (state->dup == JD_ERROR)
+        {
+            state->key_offsets.resize(state->nkeys);
+            state->key_offsets.push_back(state->base + (at - state->begin));
+        }
+        push_key(state, k, len, borrow);
+        v = push_value(state);
+        return true;
+    }
+    bool string(const char *s, size_t len, bool borrow)
+    {
+        v->internal_build_string(s, len, borrow, state->alloc);
+        return true;
+    }
+    bool scalar(const char *s, const char *e)
+    {
+        char local[64];
+        const char *num = NULL;
+        switch (read_scalar(state, s, e, local, num))
+        {
+        case SC_NULL: break;
+        case SC_TRUE: v->internal_build_bool(true); break;
+        case SC_FALSE: v->internal_build_bool(false); break;
+        case SC_INTEGER: v->internal_build_integer(num); break;
+        case SC_FLOAT: v->internal_build_float(num); break;
+        case SC_WORD: v->internal_build_string(s, e - s, false, state->alloc); break;
+        }
+        return true;
+    }
+    scan_state *state;
+    Value *root;
+    Value *v;   // value to be filled by the next token, stays valid
+                // until the next push
+};
+
+struct sax_events
+{
+    sax_events(scan_state *_state, Handler *_handler)
+        :state(_state),handler(_handler){}
+    bool open(scan_frame &f)
+    {
+        f.count = 0;
+        return f.array ? handler->StartArray() : handler->StartObject();
+    }
+    bool close(const scan_frame &f)
+    {
+        return f.array ? handler->EndArray(f.count) : handler->EndObject(f.count);
+    }
+    void element()
+    {
+        state->stack.back().count++;
+    }
+    bool key(const char *, const char *k, size_t len, bool)
+    {
+        state->stack.back().count++;
+        return handler->Key(k, len);
+    }
+    bool string(const char *s, size_t len, bool)
+    {
+        return handler->String(s, len);
+    }
+    bool scalar(const char *s, const char *e)
+    {
+        char local[64];
+        const char *num = NULL;
+        switch (read_scalar(state, s, e, local, num))
+        {
+        case SC_NULL: return handler->Null();
+        case SC_TRUE: return handler->Bool(true);
+        case SC_FALSE: return handler->Bool(false);
+        case SC_INTEGER: return handler->Int(fs2i(num));
+        case SC_FLOAT: return handler->Double(jsstrtod(num, NULL));
+        case SC_WORD: return handler->String(s, e - s);
+        }
+        return true;
+    }
+    scan_state *state;
+    Handler *handler;
+};
+
+template <class CURSOR, class EVENTS>
+static void fast_parse(scan_state *state, EVENTS &events)
+{
+    CURSOR cursor(state);
+    const char *end = state->end;
+    const char *p = cursor.next(state->begin, end);
+
+parse_value:
+    if (p >= end)
+    {
+        scan_error(state, p);
+    }
+    switch (*p)
+    {
+    case '{':
+    case '[':
+        if (state->stack.size() >= STACK_MAX_SIZE)
+        {
+            scan_error(state, p);
+        }
+        {
+            scan_frame f;
+            f.array = *p == '[';
+            if (!events.open(f))
+            {
+                scan_error(state, p);
+            }
+            state->stack.push_back(f);
+        }
+        if (*p == '{')
+        {
+            p = cursor.next(p + 1, end);
+            if (p < end && *p == '}')
+            {
+                p++;
+                goto close_container;
+            }
+            goto parse_key;
+        }
+        p = cursor.next(p + 1, end);
+        if (p < end && *p == ']')
+        {
+            p++;
+            goto close_container;
+        }
+        events.element();
+        goto parse_value;
+
+    case '\"':
+    case '\'':
+        {
+            const char *s;
+            size_t len;
+            bool borrow;
+            const char *at = p;
+            p = scan_string(state, p, s, len, borrow);
+            if (!events.string(s, len, borrow))
+            {
+                scan_error(state, at);
+            }
+        }
+        break;
+
+    default:
+        {
+            const char *s = p;
+            p = scan_token(p, end);
+            if (s == p)
+            {
+                scan_error(state, p);
+            }
+            if (!events.scalar(s, p))
+            {
+                scan_error(state, s);
+            }
+        }
+        break;
+    }
+
+parse_next:
+    p = cursor.next(p, end);
+    if (state->stack.empty())
+    {
+        if (p != end)
+        {
+            scan_error(state, p);
+        }
+        return;
+    }
+    if (p >= end)
+    {
+        scan_error(state, p);
+    }
+    if (state->stack.back().array)
+    {
+        if (*p == ',')
+        {
+            p = cursor.next(p + 1, end);
+            if (p < end && *p == ']')
+            {
+                p++;
+                goto close_container;
+            }
+            events.element();
+            goto parse_value;
+        }
+        if (*p != ']')
+        {
+            scan_error(state, p);
+        }
+        p++;
+        goto close_container;
+    }
+
+    if (*p == ',')
+    {
+        p = cursor.next(p + 1, end);
+        if (p < end && *p == '}')
+        {
+            p++;
+            goto close_container;
+        }
+        goto parse_key;
+    }
+    if (*p != '}')
+    {
+        scan_error(state, p);
+    }
+    p++;
+
+close_container:
+    {
+        scan_frame f = state->stack.back();
+        state->stack.pop_back();
+        if (!events.close(f))
+        {
+            scan_error(state, p - 1);
+        }
+    }
+    goto parse_next;
+
+parse_key:
+    if (p >= end)
+    {
+        scan_error(state, p);
+    }
+    {
+        const char *at = p;
+        const char *k;
+        size_t klen;
+        bool borrow = false;
+        if (is_class(*p, C_QUOTE))
+        {
+            p = scan_string(state, p, k, klen, borrow);
+        }
+        else
+        {
+            k = p;
+            p = scan_token(p, end);
+            klen = p - k;
+            if (klen == 0)
+            {
+                scan_error(state, p);
+            }
+        }
+        if (!events.key(at, k, klen, borrow))
+        {
+            scan_error(state, at);
+        }
+    }
+    p = cursor.next(p, end);
+    if (p >= end || *p != ':')
+    {
+        scan_error(state, p);
+    }
+    p = cursor.next(p + 1, end);
+    goto parse_value;
+}
+
+template <class EVENTS>
+static void scan(scan_state *state, const char *score, size_t len, char *insitu, EVENTS &events)
+{
+    struct release_guard
+    {
+        scan_state *state;
+        ~release_guard() {state->release();}
+    } guard = {state};
+    state->begin = score;
+    state->end = score + len;
+    state->base = 0;
+    state->insitu = insitu;
+    if (STRUCTURAL_INDEX && len >= INDEX_MIN_SIZE && build_structural_index(state))
+    {
+        fast_parse<indexed_cursor>(state, events);
+    }
+    else
+    {
+        fast_parse<plain_cursor>(state, events);
+    }
+}
+
+static void _parse(scan_state *state, const char *score, size_t len, Value *root, char *insitu)
+{
+    if (FAST_PARSE)
+    {
+        dom_builder dom(state, root);
+        scan(state, score, len, insitu, dom);
+    }
+    else
+    {
+        legacy_parse(score, len, root, insitu, state->alloc, state->dup, state->key_table);
+    }
+}
+
+// handlers always get the fast parser, the legacy one only builds trees
+static void _parse(scan_state *state, const char *score, size_t len, Handler *handler)
+{
+    sax_events sax(state, handler);
+    scan(state, score, len, NULL, sax);
+}
+
+/*
+    push parsing reads each piece with the same scanners and events as
+    fast_parse and keeps its place in the grammar in state->expect between
+    pieces. A string or bare word that runs off the end of a piece is copied
+    to carry and read from there once its end arrives, everything else is
+    read straight from the pieces
+*/
+
+// where the string or bare word starting with first ends, scanning on from
+// p: past the closing quote or on the byte after the word, NULL when it
+// runs on past end. escaped keeps a backslash at the end for the next piece
+static const char *token_end(char first, const char *p, const char *end, bool &escaped)
+{
+    if (!is_class(first, C_QUOTE))
+    {
+        p = scan_token(p, end);
+        return p < end ? p : NULL;
+    }
+    for (;;)
+    {
+        if (escaped)
+        {
+            if (p >= end)
+            {
+                return NULL;
+            }
+            p++;
+            escaped = false;
+        }
+        p = scan_string_run(p, end, first);
+        if (p >= end)
+        {
+            return NULL;
+        }
+        if (*p == first)
+        {
+            return p + 1;
+        }
+        escaped = true;
+        p++;
+    }
+}
+
+// the whole key or value token in [s, e)
+template <class EVENTS>
+static void push_token(scan_state *state, EVENTS &events, const char *s, const char *e)
+{
+    if (state->expect == PX_MEMBER)
+    {
+        const char *k = s;
+        size_t klen = e - s;
+        bool borrow = false;
+        if (is_class(*s, C_QUOTE))
+        {
+            scan_string(state, s, k, klen, borrow);
+        }
+        if (!events.key(s, k, klen, borrow))
+        {
+            scan_error(state, s);
+        }
+        state->expect = PX_COLON;
+        return;
+    }
+    if (is_class(*s, C_QUOTE))
+    {
+        const char *str;
+        size_t len;
+        bool borrow;
+        scan_string(state, s, str, len, borrow);
+        if (!events.string(str, len, borrow))
+        {
+            scan_error(state, s);
+        }
+    }
+    else if (!events.scalar(s, e))
+    {
+        scan_error(state, s);
+    }
+    state->expect = PX_NEXT;
+}
+
+template <class EVENTS>
+static void push_carry(scan_state *state, EVENTS &events)
+{
+    const char *s = &state->carry[0];
+    state->begin = s;
+    state->end = s + state->carry.size();
+    state->base = state->carry_at;
+    push_token(state, events, s, state->end);
+    state->carry.clear();
+}
+
+template <class EVENTS>
+static void push_close(scan_state *state, EVENTS &events, const char *p)
+{
+    scan_frame f = state->stack.back();
+    state->stack.pop_back();
+    if (!events.close(f))
+    {
+        scan_error(state, p);
+    }
+    state->expect = PX_NEXT;
+}
+
+template <class EVENTS>
+static void push_piece(scan_state *state, EVENTS &events, const char *p, const char *end)
+{
+    const char *piece = p;
+    if (!state->carry.empty())
+    {
+        p = token_end(state->carry[0], p, end, state->escaped);
+        state->carry.insert(state->carry.end(), piece, p ? p : end);
+        if (!p)
+        {
+            return;
+        }
+        push_carry(state, events);
+    }
+    state->begin = piece;
+    state->end = end;
+    state->base = state->fed;
+
+    for (;;)
+    {
+        p = skip_space(p, end);
+        if (p >= end)
+        {
+            return;
+        }
+        switch (state->expect)
+        {
+        case PX_NEXT:
+            if (state->stack.empty())
+            {
+                scan_error(state, p);
+            }
+            if (*p == ',')
+            {
+                state->expect = state->stack.back().array ? PX_ELEMENT : PX_MEMBER;
+            }
+            else if (*p == (state->stack.back().array ? ']' : '}'))
+            {
+                push_close(state, events, p);
+            }
+            else
+            {
+                scan_error(state, p);
+            }
+            p++;
+            continue;
+        case PX_COLON:
+            if (*p != ':')
+            {
+                scan_error(state, p);
+            }
+            state->expect = PX_VALUE;
+            p++;
+            continue;
+        case PX_ELEMENT:
+            if (*p == ']')
+            {
+                push_close(state, events, p);
+                p++;
+                continue;
+            }
+            events.element();
+            state->expect = PX_VALUE;
+            continue;
+        case PX_MEMBER:
+            if (*p == '}')
+            {
+                push_close(state, events, p);
+                p++;
+                continue;
+            }
+            break;
+        case PX_VALUE:
+            if (*p == '{' || *p == '[')
+            {
+                if (state->stack.size() >= STACK_MAX_SIZE)
+                {
+                    scan_error(state, p);
+                }
+                scan_frame f;
+                f.array = *p == '[';
+                if (!events.open(f))
+                {
+                    scan_error(state, p);
+                }
+                state->stack.push_back(f);
+                state->expect = f.array ? PX_ELEMENT : PX_MEMBER;
+                p++;
+                continue;
+            }
+            break;
+        }
+
+        // a key or a value token
+        if (is_class(*p, C_SYMBOL))
+        {
+            scan_error(state, p);
+        }
+        const char *e = token_end(*p, is_class(*p, C_QUOTE) ? p + 1 : p, end, state->escaped);
+        if (!e)
+        {
+            state->carry.assign(p, end);
+            state->carry_at = state->base + (p - state->begin);
+            return;
+        }
+        push_token(state, events, p, e);
+        p = e;
+    }
+}
+
+// a bare word still in carry ends with the document
+template <class EVENTS>
+static void push_end(scan_state *state, EVENTS &events)
+{
+    if (!state->carry.empty() && !is_class(state->carry[0], C_QUOTE))
+    {
+        push_carry(state, events);
+    }
+    if (!state->carry.empty() || state->expect != PX_NEXT || !state->stack.empty())
+    {
+        throw tjException(state->fed + 1);
+    }
+}
+
+// runs a piece, or the end of the document, through what start chose
+static void _push(scan_state *state, const char *s, size_t len, bool last)
+{
+    if (state->handler)
+    {
+        sax_events sax(state, state->handler);
+        if (last)
+        {
+            push_end(state, sax);
+        }
+        else
+        {
+            push_piece(state, sax, s, s + len);
+        }
+        return;
+    }
+    dom_builder dom(state, state->root);
+    if (!state->stack.empty() && state->nvalues)
+    {
+        dom.v = &state->values[state->nvalues - 1]; // where a pending value goes
+    }
+    if (last)
+    {
+        push_end(state, dom);
+    }
+    else
+    {
+        push_piece(state, dom, s, s + len);
+    }
+}
+
+size_t tjson::parse(const char *s, size_t len, Value *root, Allocator *alloc, DuplicateKeys dup)
+{
+    try {
+        scan_state state;
+        state.alloc = alloc;
+        state.dup = dup;
+        _parse(&state, s, len, root, NULL);
+        return 0;
+    } catch(tjException &ex) {
+        return ex.pos;
+    }    
+}
+
+size_t tjson::parse(const char *s, size_t len, Handler *handler)
+{
+    try {
+        scan_state state;
+        _parse(&state, s, len, handler);
+        return 0;
+    } catch(tjException &ex) {
+        return ex.pos;
+    }    
+}
+
+size_t tjson::parse_insitu(char *buf, size_t len, Value *root, Allocator *alloc, DuplicateKeys dup)
+{
+    try {
+        scan_state state;
+        state.alloc = alloc;
+        state.dup = dup;
+        _parse(&state, buf, len, root, buf);
+        return 0;
+    } catch(tjException &ex) {
+        return ex.pos;
+    }    
+}
+
+tjson::Parser::Parser()
+    :m_state(new scan_state)
+{
+}
+
+tjson::Parser::~Parser()
+{
+    delete m_state;
+}
+
+void tjson::Parser::set_duplicate_keys(DuplicateKeys dup)
+{
+    m_state->dup = dup;
+}
+
+void tjson::Parser::set_key_table(KeyTable *keys)
+{
+    m_state->key_table = keys;
+}
+
+void tjson::Parser::reset()
+{
+    m_state->begin = NULL;
+    m_state->end = NULL;
+    m_state->base = 0;
+    m_state->insitu = NULL;
+    m_state->alloc = NULL;
+    m_state->release();
+    m_state->expect = PX_NEXT;
+    m_state->root = NULL;
+    m_state->handler = NULL;
+    m_state->escaped = false;
+    m_state->carry_at = 0;
+    m_state->fed = 0;
+    m_state->error = 0;
+}
+
+size_t tjson::Parser::parse(const char *s, size_t len, Value *root, Allocator *alloc)
+{
+    reset();
+    m_state->alloc = alloc;
+    try {
+        _parse(m_state, s, len, root, NULL);
+        return 0;
+    } catch(tjException &ex) {
+        return ex.pos;
+    }    
+}
+
+size_t tjson::Parser::parse_insitu(char *buf, size_t len, Value *root, Allocator *alloc)
+{
+    reset();
+    m_state->alloc = alloc;
+    try {
+        _parse(m_state, buf, len, root, buf);
+        return 0;
+    } catch(tjException &ex) {
+        return ex.pos;
+    }    
+}
+
+size_t tjson::Parser::parse(const char *s, size_t len, Handler *handler)
+{
+    reset();
+    try {
+        _parse(m_state, s, len, handler);
+        return 0;
+    } catch(tjException &ex) {
+        return ex.pos;
+    }    
+}
+
+size_t tjson::Parser::parse(const char *s, size_t len, Document *doc)
+{
+    reset();
+    doc->clear();
+    m_state->alloc = &doc->m_arena;
+    try {
+        _parse(m_state, s, len, doc->m_root, NULL);
+        return 0;
+    } catch(tjException &ex) {
+        return ex.pos;
+    }    
+}
+
+size_t tjson::Parser::parse_insitu(char *buf, size_t len, Document *doc)
+{
+    reset();
+    doc->clear();
+    m_state->alloc = &doc->m_arena;
+    try {
+        _parse(m_state, buf, len, doc->m_root, buf);
+        return 0;
+    } catch(tjException &ex) {
+        return ex.pos;
+    }    
+}
+
+void tjson::Parser::start(Value *root, Allocator *alloc)
+{
+    reset();
+    m_state->alloc = alloc;
+    m_state->root = root;
+    m_state->expect = PX_VALUE;
+}
+
+void tjson::Parser::start(Document *doc)
+{
+    reset();
+    doc->clear();
+    m_state->alloc = &doc->m_arena;
+    m_state->root = doc->m_root;
+    m_state->expect = PX_VALUE;
+}
+
+void tjson::Parser::start(Handler *handler)
+{
+    reset();
+    m_state->handler = handler;
+    m_state->expect = PX_VALUE;
+}
+
+size_t tjson::Parser::feed(const char *s, size_t len)
+{
+    if (m_state->error)
+    {
+        return m_state->error;
+    }
+    try {
+        _push(m_state, s, len, false);
+        m_state->fed += len;
+        return 0;
+    } catch(tjException &ex) {
+        m_state->release();
+        m_state->error = ex.pos;
+        return ex.pos;
+    }    
+}
+
+size_t tjson::Parser::finish()
+{
+    if (m_state->error)
+    {
+        return m_state->error;
+    }
+    try {
+        _push(m_state, NULL, 0, true);
+        return 0;
+    } catch(tjException &ex) {
+        m_state->release();
+        m_state->error = ex.pos;
+        return ex.pos;
+    }    
+}
+
+tjson::Document::Document(Allocator *upstream)
+    :m_arena(upstream)
+    ,m_root(NULL)
+{
+    clear();
+}
+
+void tjson::Document::clear()
+{
+    m_arena.clear();
+    m_root = new (m_arena.alloc(sizeof(Value))) Value;
+    m_root->m_alloc = &m_arena;
+}
+
+size_t tjson::Document::parse(const char *s, size_t len, DuplicateKeys dup)
+{
+    clear();
+    try {
+        scan_state state;
+        state.alloc = &m_arena;
+        state.dup = dup;
+        _parse(&state, s, len, m_root, NULL);
+        return 0;
+    } catch(tjException &ex) {
+        return ex.pos;
+    }    
+}
+
+size_t tjson::Document::parse_insitu(char *buf, size_t len, DuplicateKeys dup)
+{
+    clear();
+    try {
+        scan_state state;
+        state.alloc = &m_arena;
+        state.dup = dup;
+        _parse(&state, buf, len, m_root, buf);
+        return 0;
+    } catch(tjException &ex) {
+        return ex.pos;
+    }    
+}
+
+tjson::LineReader::LineReader(Allocator *upstream)
+    :m_doc(upstream)
+    ,m_pos(NULL)
+    ,m_end(NULL)
+    ,m_line(0)
+    ,m_error(0)
+{
+}
+
+void tjson::LineReader::set_duplicate_keys(DuplicateKeys dup)
+{
+    m_parser.set_duplicate_keys(dup);
+}
+
+void tjson::LineReader::set_key_table(KeyTable *keys)
+{
+    m_parser.set_key_table(keys);
+}
+
+void tjson::LineReader::start(const char *s, size_t len)
+{
+    m_pos = s;
+    m_end = s + len;
+    m_line = 0;
+    m_error = 0;
+}
+
+bool tjson::LineReader::next()
+{
+    while (m_pos < m_end)
+    {
+        const char *s = m_pos;
+        const char *e = (const char*)memchr(s, '\n', m_end - s);
+        if (!e)
+        {
+            e = m_end;
+        }
+        m_pos = e < m_end ? e + 1 : e;
+        m_line++;
+        if (skip_space(s, e) != e)
+        {
+            m_error = m_parser.parse(s, e - s, &m_doc);
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t tjson::LineReader::read(const char *s, size_t len, LineHandler *handler)
+{
+    size_t n = 0;
+    start(s, len);
+    while (next())
+    {
+        if (m_error)
+        {
+            if (!handler->error(m_line, m_error))
+            {
+                break;
+            }
+            continue;
+        }
+        n++;
+        if (!handler->record(m_line, root()))
+        {
+            break;
+        }
+    }
+    return n;
+}
+
+// FNV-1a
+static inline unsigned int hash_key(const char *k, size_t len)
+{
+    unsigned int h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+    {
+        h = (h ^ (unsigned char)k[i]) * 16777619u;
+    }
+    return h;
+}
+
+// the low bits pick the slot, fold the well mixed high ones into them
+static inline size_t slot_of(unsigned int h, size_t capacity)
+{
+    return (h ^ (h >> 16)) & (capacity - 1);
+}
+
+tjson::KeyTable::KeyTable(Allocator *upstream)
+    :m_arena(upstream)
+    ,m_slots(NULL)
+    ,m_capacity(0)
+    ,m_size(0)
+{
+}
+
+tjson::KeyTable::~KeyTable()
+{
+    free(m_slots);
+}
+
+size_t tjson::KeyTable::memory_usage() const
+{
+    return m_arena.reserved() + sizeof(StringData*) * m_capacity;
+}
+
+void tjson::KeyTable::clear()
+{
+    m_arena.clear();
+    if (m_slots)
+    {
+        memset(m_slots, 0, sizeof(StringData*) * m_capacity);
+    }
+    m_size = 0;
+}
+
+// doubles the slots, at most half of them are ever used
+void tjson::KeyTable::grow()
+{
+    size_t capacity = m_capacity ? m_capacity * 2 : 64;
+    StringData **slots = (StringData**)calloc(capacity, sizeof(StringData*));
+    if (!slots)
+    {
+        throw std::bad_alloc();
+    }
+    for (size_t i = 0; i < m_capacity; i++)
+    {
+        if (m_slots[i])
+        {
+            size_t j = slot_of(m_slots[i]->hash, capacity);
+            while (slots[j])
+            {
+                j = (j + 1) & (capacity - 1);
+            }
+            slots[j] = m_slots[i];
+        }
+    }
+    free(m_slots);
+    m_slots = slots;
+    m_capacity = capacity;
+}
+
+StringData *tjson::KeyTable::internal_find_or_add(const char *k, size_t len)
+{
+    if ((m_size + 1) * 2 > m_capacity)
+    {
+        grow();
+    }
+    unsigned int h = hash_key(k, len);
+    size_t i = slot_of(h, m_capacity);
+    while (m_slots[i])
+    {
+        StringData *d = m_slots[i];
+        if (d->hash == h && d->value_size == len && memcmp(d->buff, k, len) == 0)
+        {
+            return d;
+        }
+        i = (i + 1) & (m_capacity - 1);
+    }
+    StringData *d = (StringData*)m_arena.alloc(sizeof(StringData) + len + 1);
+    d->buff = (char*)(d + 1);
+    memcpy(d->buff, k, len);
+    d->buff[len] = 0;
+    d->allocator = &m_arena;
+    d->value_size = len;
+    d->hash = h;
+    d->borrowed = false;
+    d->interned = true;
+    m_slots[i] = d;
+    m_size++;
+    return d;
+}
+
+/*
+    writer: compact JSON into a growing buffer, or a fixed one that is
+    flushed to a sink whenever it fills up
+*/
+
+struct tjson::internal::write_state
+{
+    write_state()
+        :buff(NULL),size(0),capacity(0),sink(NULL)
+        ,indent(0),indent_char(' '),canonical(false),depth(0){}
+    ~write_state() {free(buff);}
+    char *buff;
+    size_t size;
+    size_t capacity;
+    Sink *sink;         // NULL while writing into the buffer
+    unsigned indent;    // per level, 0 for compact
+    char indent_char;
+    bool canonical;
+    size_t depth;
+    std::vector<const MapData::pair*> order; // sorted members of the open objects
+
+    // room for n more bytes at buff + size
+    void reserve(size_t n)
+    {
+        if (capacity - size >= n)
+        {
+            return;
+        }
+        if (sink)
+        {
+            flush();
+            if (capacity >= n)
+            {
+                return;
+            }
+        }
+        size_t new_capacity = capacity ? capacity * 2 : WRITE_CHUNK_SIZE;
+        if (new_capacity - size < n)
+        {
+            new_capacity = size + n;
+        }
+        char *p = (char*)realloc(buff, new_capacity);
+        if (!p)
+        {
+            throw std::bad_alloc();
+        }
+        buff = p;
+        capacity = new_capacity;
+    }
+    void flush()
+    {
+        if (size)
+        {
+            sink->write(buff, size);
+            size = 0;
+        }
+    }
+    void put(char c)
+    {
+        reserve(1);
+        buff[size++] = c;
+    }
+    void put(const char *s, size_t n)
+    {
+        // runs longer than the buffer go to the sink as they are
+        if (sink && n > capacity - size)
+        {
+            flush();
+            if (n >= capacity)
+            {
+                sink->write(s, n);
+                return;
+            }
+        }
+        reserve(n);
+        memcpy(buff + size, s, n);
+        size += n;
+    }
+    // a line break and the indent of the current depth, pretty only
+    void newline()
+    {
+        if (indent && !canonical)
+        {
+            size_t n = indent * depth;
+            reserve(n + 1);
+            buff[size] = '\n';
+            memset(buff + size + 1, indent_char, n);
+            size += n + 1;
+        }
+    }
+    void value(const Value &v);
+    void members(const Value &v);
+    void string(const char *s, size_t n);
+    static bool key_less(const MapData::pair *a, const MapData::pair *b);
+};
+
+static const char digit_pairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// the digits of v two at a time from the back, returns the end
+static char *format_uint(char *out, unsigned long long v)
+{
+    char tmp[20];
+    char *p = tmp + sizeof(tmp);
+    while (v >= 100)
+    {
+        const char *d = &digit_pairs[(v % 100) * 2];
+        v /= 100;
+        *--p = d[1];
+        *--p = d[0];
+    }
+    if (v >= 10)
+    {
+        *--p = digit_pairs[v * 2 + 1];
+        *--p = digit_pairs[v * 2];
+    }
+    else
+    {
+        *--p = (char)('0' + v);
+    }
+    size_t n = tmp + sizeof(tmp) - p;
+    memcpy(out, p, n);
+    return out + n;
+}
+
+static char *format_int(char *out, long long v)
+{
+    if (v < 0)
+    {
+        *out++ = '-';
+        return format_uint(out, 0ULL - (unsigned long long)v);
+    }
+    return format_uint(out, (unsigned long long)v);
+}
+
+/*
+    Grisu2 (Loitsch, "Printing floating-point numbers quickly and
+    accurately with integers"): the shortest digits that read back as the
+    same double in all but a handful of cases, and always digits that do
+*/
+
+struct diy_fp
+{
+    diy_fp(uint64_t _f, int _e):f(_f),e(_e){}
+    uint64_t f;
+    int e;
+};
+
+static inline diy_fp fp_sub(diy_fp a, diy_fp b)
+{
+    return diy_fp(a.f - b.f, a.e);
+}
+
+// the upper 64 bits of the product, rounded
+static inline diy_fp fp_mul(diy_fp a, diy_fp b)
+{
+    const uint64_t M32 = 0xFFFFFFFFu;
+    uint64_t ah = a.f >> 32, al = a.f & M32, bh = b.f >> 32, bl = b.f & M32;
+    uint64_t hh = ah * bh, lh = al * bh, hl = ah * bl, ll = al * bl;
+    uint64_t mid = (ll >> 32) + (hl & M32) + (lh & M32) + (1u << 31);
+    return diy_fp(hh + (hl >> 32) + (lh >> 32) + (mid >> 32), a.e + b.e + 64);
+}
+
+static inline diy_fp fp_normalize(diy_fp x)
+{
+    while (!(x.f & (1ULL << 63)))
+    {
+        x.f <<= 1;
+        x.e--;
+    }
+    return x;
+}
+
+// 10^k for k = -348, -340 ... 340, normalized
+static const uint64_t cached_pow10_f[] =
+{
+    0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL,
+    0xcf42894a5dce35eaULL, 0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL,
+    0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL, 0xbe5691ef416bd60cULL,
+    0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+    0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL,
+    0xc21094364dfb5637ULL, 0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL,
+    0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL, 0xb23867fb2a35b28eULL,
+    0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+    0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL,
+    0xb5b5ada8aaff80b8ULL, 0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL,
+    0x964e858c91ba2655ULL, 0xdff9772470297ebdULL, 0xa6dfbd9fb8e5b88fULL,
+    0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+    0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL,
+    0xaa242499697392d3ULL, 0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL,
+    0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL, 0x9c40000000000000ULL,
+    0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+    0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL,
+    0x9f4f2726179a2245ULL, 0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL,
+    0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL, 0x924d692ca61be758ULL,
+    0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+    0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL,
+    0x952ab45cfa97a0b3ULL, 0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL,
+    0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL, 0x88fcf317f22241e2ULL,
+    0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+    0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL,
+    0x8bab8eefb6409c1aULL, 0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL,
+    0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL, 0x80444b5e7aa7cf85ULL,
+    0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+    0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL,
+};
+
+static const short cached_pow10_e[] =
+{
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+    -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+    -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+    -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+    -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+    109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+    375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+    641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+    907, 933, 960, 986, 1013, 1039, 1066,
+};
+
+// a power of ten that brings a product with 2^e into [2^-60, 2^-32),
+// *k gets its decimal exponent negated
+static diy_fp cached_pow10(int e, int *k)
+{
+    double dk = (-61 - e) * 0.30102999566398114 + 347;
+    int ik = (int)dk;
+    if (dk - ik > 0.0)
+    {
+        ik++;
+    }
+    unsigned index = (unsigned)((ik >> 3) + 1);
+    *k = -(-348 + (int)index * 8);
+    return diy_fp(cached_pow10_f[index], cached_pow10_e[index]);
+}
+
+static const uint32_t pow10_32[] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000};
+
+// moves the last digit towards w while it stays inside the bounds
+static inline void grisu_round(char *buff, int len, uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t wp_w)
+{
+    while (rest < wp_w && delta - rest >= ten_kappa &&
+           (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w))
+    {
+        buff[len - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+static void grisu_digits(diy_fp w, diy_fp mp, uint64_t delta, char *buff, int *len, int *k)
+{
+    const diy_fp one(1ULL << -mp.e, mp.e);
+    const uint64_t wp_w = fp_sub(mp, w).f;
+    uint32_t p1 = (uint32_t)(mp.f >> -one.e);
+    uint64_t p2 = mp.f & (one.f - 1);
+    int kappa = 1;
+    while (kappa < 10 && p1 >= pow10_32[kappa])
+    {
+        kappa++;
+    }
+    *len = 0;
+    while (kappa > 0)
+    {
+        uint32_t d = p1 / pow10_32[kappa - 1];
+        p1 %= pow10_32[kappa - 1];
+        if (d || *len)
+        {
+            buff[(*len)++] = (char)('0' + d);
+        }
+        kappa--;
+        uint64_t rest = ((uint64_t)p1 << -one.e) + p2;
+        if (rest <= delta)
+        {
+            *k += kappa;
+            grisu_round(buff, *len, delta, rest, (uint64_t)pow10_32[kappa] << -one.e, wp_w);
+            return;
+        }
+    }
+    for (;;)
+    {
+        p2 *= 10;
+        delta *= 10;
+        char d = (char)(p2 >> -one.e);
+        if (d || *len)
+        {
+            buff[(*len)++] = (char)('0' + d);
+        }
+        p2 &= one.f - 1;
+        kappa--;
+        if (p2 < delta)
+        {
+            *k += kappa;
+            grisu_round(buff, *len, delta, p2, one.f, -kappa < 10 ? wp_w * pow10_32[-kappa] : 0);
+            return;
+        }
+    }
+}
+
+// the digits of a finite v > 0, v = digits * 10^k
+static void grisu2(double v, char *buff, int *len, int *k)
+{
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    int biased_e = (int)((bits >> 52) & 0x7FF);
+    uint64_t significand = bits & 0x000FFFFFFFFFFFFFULL;
+    diy_fp w = biased_e ? diy_fp(significand | (1ULL << 52), biased_e - 1075) : diy_fp(significand, -1074);
+
+    // the boundaries halfway to the neighbouring doubles
+    diy_fp plus(w.f * 2 + 1, w.e - 1);
+    while (!(plus.f & (1ULL << 53)))
+    {
+        plus.f <<= 1;
+        plus.e--;
+    }
+    plus.f <<= 10;
+    plus.e -= 10;
+    diy_fp minus = w.f == (1ULL << 52) ? diy_fp(w.f * 4 - 1, w.e - 2) : diy_fp(w.f * 2 - 1, w.e - 1);
+    minus.f <<= minus.e - plus.e;
+    minus.e = plus.e;
+
+    int mk;
+    diy_fp c = cached_pow10(plus.e, &mk);
+    diy_fp W = fp_mul(fp_normalize(w), c);
+    diy_fp Wp = fp_mul(plus, c);
+    diy_fp Wm = fp_mul(minus, c);
+    Wm.f++;
+    Wp.f--;
+    *k = mk;
+    grisu_digits(W, Wp, Wp.f - Wm.f, buff, len, k);
+}
+
+static char *format_exponent(char *out, int e)
+{
+    *out++ = 'e';
+    if (e < 0)
+    {
+        *out++ = '-';
+        e = -e;
+    }
+    return format_uint(out, (unsigned long long)e);
+}
+
+// d.ddde(point - 1)
+static char *format_scientific(char *out, const char *digits, int len, int point)
+{
+    *out++ = digits[0];
+    if (len > 1)
+    {
+        *out++ = '.';
+        memcpy(out, digits + 1, len - 1);
+        out += len - 1;
+    }
+    return format_exponent(out, point - 1);
+}
+
+// digits * 10^k laid out the way people write numbers. Whole numbers get
+// a ".0" so they read back as doubles, unless they are to look like
+// integers
+static char *format_digits(char *out, const char *digits, int len, int k, bool as_double)
+{
+    int point = len + k; // digits before the decimal point
+    if (k >= 0 && point <= 21)
+    {
+        memcpy(out, digits, len);
+        memset(out + len, '0', k);
+        out += point;
+        if (as_double)
+        {
+            *out++ = '.';
+            *out++ = '0';
+        }
+    }
+    else if (point > 0 && point <= 21)
+    {
+        memcpy(out, digits, point);
+        out[point] = '.';
+        memcpy(out + point + 1, digits + point, len - point);
+        out += len + 1;
+    }
+    else if (point > -6 && point <= 0)
+    {
+        *out++ = '0';
+        *out++ = '.';
+        memset(out, '0', -point);
+        memcpy(out - point, digits, len);
+        out += len - point;
+    }
+    else
+    {
+        out = format_scientific(out, digits, len, point);
+    }
+    return out;
+}
+
+// at most 25 bytes
+static char *format_double(char *out, double v, bool as_double)
+{
+    if (v != v || v - v != 0)
+    {
+        memcpy(out, "null", 4);
+        return out + 4;
+    }
+    if (v == 0)
+    {
+        uint64_t bits;
+        memcpy(&bits, &v, sizeof(bits));
+        if (as_double && bits >> 63)
+        {
+            *out++ = '-';
+        }
+        memcpy(out, "0.0", 3);
+        return out + (as_double ? 3 : 1);
+    }
+    if (v < 0)
+    {
+        *out++ = '-';
+        v = -v;
+    }
+    char digits[18];
+    int len, k;
+    grisu2(v, digits, &len, &k);
+    if (!as_double && v >= 9007199254740992.0)
+    {
+        // past 2^53 the integer form may not read back as this value
+        return format_scientific(out, digits, len, len + k);
+    }
+    return format_digits(out, digits, len, k, as_double);
+}
+
+// up to the next byte a JSON string has to escape: quote, backslash and
+// control characters
+static inline const char *scan_plain_run(const char *p, const char *end)
+{
+#ifdef SIMD_WIDTH
+    while (end - p >= SIMD_WIDTH)
+    {
+        simd_t v = simd_load(p);
+        uint32_t stop = simd_mask(simd_or(simd_or(simd_eq(v, '"'), simd_eq(v, '\\')), simd_le(v, 0x1F)));
+        if (stop)
+        {
+            return p + first_bit(stop);
+        }
+        p += SIMD_WIDTH;
+    }
+#elif defined(SWAR_WIDTH)
+    while (end - p >= SWAR_WIDTH)
+    {
+        uint64_t x;
+        memcpy(&x, p, sizeof(x));
+        // bytes below 0x20, exact up to the first one
+        uint64_t control = (x - 0x2020202020202020ULL) & ~x & 0x8080808080808080ULL;
+        uint64_t stop = swar_byte_mask(x, '"') | swar_byte_mask(x, '\\') | control;
+        if (stop)
+        {
+            return p + first_bit(stop) / 8;
+        }
+        p += SWAR_WIDTH;
+    }
+#endif
+    while (p < end && *p != '"' && *p != '\\' && (unsigned char)*p >= 0x20)
+    {
+        p++;
+    }
+    return p;
+}
+
+void tjson::internal::write_state::string(const char *s, size_t n)
+{
+    static const char hex[] = "0123456789abcdef";
+    const char *end = s + n;
+    put('"');
+    for (;;)
+    {
+        const char *run = scan_plain_run(s, end);
+        put(s, run - s);
+        if (run == end)
+        {
+            break;
+        }
+        unsigned char c = (unsigned char)*run;
+        reserve(6);
+        char *out = buff + size;
+        out[0] = '\\';
+        switch (c)
+        {
+        case '"': out[1] = '"'; size += 2; break;
+        case '\\': out[1] = '\\'; size += 2; break;
+        case '\b': out[1] = 'b'; size += 2; break;
+        case '\f': out[1] = 'f'; size += 2; break;
+        case '\n': out[1] = 'n'; size += 2; break;
+        case '\r': out[1] = 'r'; size += 2; break;
+        case '\t': out[1] = 't'; size += 2; break;
+        default:
+            out[1] = 'u';
+            out[2] = '0';
+            out[3] = '0';
+            out[4] = hex[c >> 4];
+            out[5] = hex[c & 15];
+            size += 6;
+            break;
+        }
+        s = run + 1;
+    }
+    put('"');
+}
+
+void tjson::internal::write_state::value(const Value &v)
+{
+    switch (v.GetType())
+    {
+    case JT_NULL:
+        put("null", 4);
+        break;
+    case JT_BOOL:
+        if (v.m_bool)
+        {
+            put("true", 4);
+        }
+        else
+        {
+            put("false", 5);
+        }
+        break;
+    case JT_INTEGER:
+        reserve(20);
+        size = format_int(buff + size, v.m_intval) - buff;
+        break;
+    case JT_DOUBLE:
+        reserve(25);
+        size = format_double(buff + size, v.m_fval, !canonical) - buff;
+        break;
+    case JT_STRING:
+        string(v.asCString(), v.string_size());
+        break;
+    case JT_ARRAY:
+        put('[');
+        depth++;
+        for (size_t i = 0; i < v.size(); i++)
+        {
+            if (i)
+            {
+                put(',');
+            }
+            newline();
+            value(v.m_array->buff[i]);
+        }
+        depth--;
+        if (v.size())
+        {
+            newline();
+        }
+        put(']');
+        break;
+    case JT_OBJECT:
+        put('{');
+        depth++;
+        members(v);
+        depth--;
+        if (v.size())
+        {
+            newline();
+        }
+        put('}');
+        break;
+    }
+}
+
+// key byte order, equal keys in the order they were added
+bool tjson::internal::write_state::key_less(const MapData::pair *a, const MapData::pair *b)
+{
+    size_t la = a->key.string_size(), lb = b->key.string_size();
+    int c = memcmp(a->key.asCString(), b->key.asCString(), la < lb ? la : lb);
+    if (c || la != lb)
+    {
+        return c ? c < 0 : la < lb;
+    }
+    return a < b;
+}
+
+void tjson::internal::write_state::members(const Value &v)
+{
+    size_t n = v.size();
+    const MapData::pair *pairs = n ? v.m_dict->buff : NULL;
+    size_t first = order.size();
+    if (canonical)
+    {
+        // nested objects sort their members after these
+        for (size_t i = 0; i < n; i++)
+        {
+            order.push_back(&pairs[i]);
+        }
+        std::sort(order.begin() + first, order.end(), key_less);
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        const MapData::pair &p = canonical ? *order[first + i] : pairs[i];
+        if (i)
+        {
+            put(',');
+        }
+        newline();
+        string(p.key.asCString(), p.key.string_size());
+        put(':');
+        if (indent && !canonical)
+        {
+            put(' ');
+        }
+        value(p.value);
+    }
+    order.resize(first);
+}
+
+tjson::Writer::Writer()
+    :m_state(new write_state)
+{
+}
+
+tjson::Writer::~Writer()
+{
+    delete m_state;
+}
+
+void tjson::Writer::set_indent(unsigned n, char c)
+{
+    m_state->indent = n;
+    m_state->indent_char = c;
+}
+
+void tjson::Writer::set_canonical(bool canonical)
+{
+    m_state->canonical = canonical;
+}
+
+const char *tjson::Writer::write(const Value &v, size_t *len)
+{
+    write_state *w = m_state;
+    w->sink = NULL;
+    w->size = 0;
+    w->depth = 0;
+    w->order.clear();
+    w->value(v);
+    w->put('\0');
+    w->size--;
+    if (len)
+    {
+        *len = w->size;
+    }
+    return w->buff;
+}
+
+void tjson::Writer::write(const Value &v, Sink *sink)
+{
+    write_state *w = m_state;
+    w->size = 0;
+    w->depth = 0;
+    w->order.clear();
+    w->reserve(WRITE_CHUNK_SIZE);
+    w->sink = sink;
+    try
+    {
+        w->value(v);
+        w->flush();
+    }
+    catch (...)
+    {
+        w->sink = NULL;
+        w->size = 0;
+        throw;
+    }
+    w->sink = NULL;
+}
+
+/*
+    pool allocator: blocks up to POOL_MAX_SIZE are carved out of SLAB_SIZE
+    pages, each page serving one 8 byte size class. Every thread allocates
+    from and frees into a cache of its own without locking. A cache that
+    grows past two batches hands one batch to the shared depot and an empty
+    one takes a batch back, these transfers are the only places that lock.
+    Once the depot holds more than the retention limit, pages whose blocks
+    are all back in it are unmapped.
+*/
+#define align_size 8
+#define mem_align(d) (((d) + (align_size - 1)) & ~(align_size - 1))
+#define POOL_MAX_SIZE 4096
+#define POOL_CLASSES (POOL_MAX_SIZE / align_size)
+#define BATCH_BYTES (16 * 1024)
+#define SLAB_SIZE (64 * 1024)
+#ifndef POOL_RETENTION
+#define POOL_RETENTION (16 * 1024 * 1024) // free pool bytes kept for reuse
+#endif
+
+#ifdef _WIN32
+#define TLS_VAR __declspec(thread)
+typedef SRWLOCK pool_lock_t;
+typedef DWORD pool_key_t;
+#define POOL_LOCK_INIT SRWLOCK_INIT
+#define pool_lock(l) AcquireSRWLockExclusive(l)
+#define pool_unlock(l) ReleaseSRWLockExclusive(l)
+#else
+#define TLS_VAR __thread
+typedef pthread_mutex_t pool_lock_t;
+typedef pthread_key_t pool_key_t;
+#define POOL_LOCK_INIT PTHREAD_MUTEX_INITIALIZER
+#define pool_lock(l) pthread_mutex_lock(l)
+#define pool_unlock(l) pthread_mutex_unlock(l)
+#endif
+
+// a free block links to the next one through its first word, the first
+// block of a batch in the depot also keeps the next batch and its length
+#define next_block(p) (*(void**)(p))
+#define next_batch(p) (((void**)(p))[1])
+#define batch_len(p) (((size_t*)(p))[2])
+
+struct slab
+{
+    slab *next;      // next page of the same class
+    size_t capacity; // blocks in this page
+    size_t unused;   // its blocks found in the depot while trimming
+};
+
+#define SLAB_HEADER mem_align(sizeof(slab))
+#define slab_of(p) ((slab*)((uintptr_t)(p) & ~(uintptr_t)(SLAB_SIZE - 1)))
+
+struct free_list
+{
+    void *head;
+    size_t count;
+};
+
+struct thread_cache
+{
+    free_list lists[POOL_CLASSES];
+};
+
+// constant initialized, so it is usable before any constructor has run
+static struct pool_depot
+{
+    pool_lock_t lock;
+    size_t retention;
+    size_t trim_at;     // free_bytes that triggers the next trim
+    size_t free_bytes;  // bytes held in batches
+    void *batches[POOL_CLASSES];
+    slab *slabs[POOL_CLASSES];
+    bool key_created;
+    bool closed;        // torn down at exit, fall back to malloc
+    pool_key_t key;
+} g_depot = {POOL_LOCK_INIT, POOL_RETENTION, POOL_RETENTION, 0, {NULL}, {NULL}, false, false, 0};
+
+static TLS_VAR thread_cache *t_cache;
+
+static inline size_t pool_class(size_t s)
+{
+    if (s < 3 * sizeof(void*))
+    {
+        s = 3 * sizeof(void*);
+    }
+    return mem_align(s) / align_size - 1;
+}
+
+static inline size_t class_size(size_t idx)
+{
+    return (idx + 1) * align_size;
+}
+
+static inline size_t batch_size(size_t idx)
+{
+    size_t n = BATCH_BYTES / class_size(idx);
+    return n < 4 ? 4 : n > 64 ? 64 : n;
+}
+
+// pages are SLAB_SIZE aligned so a block finds its page by masking
+static slab *map_slab()
+{
+#ifdef _WIN32
+    // VirtualAlloc hands out 64K aligned regions
+    void *p = VirtualAlloc(NULL, SLAB_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (!p)
+    {
+        throw std::bad_alloc();
+    }
+#else
+    char *m = (char*)mmap(NULL, SLAB_SIZE * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m == MAP_FAILED)
+    {
+        throw std::bad_alloc();
+    }
+    char *p = (char*)(((uintptr_t)m + SLAB_SIZE - 1) & ~(uintptr_t)(SLAB_SIZE - 1));
+    if (p > m)
+    {
+        munmap(m, p - m);
+    }
+    munmap(p + SLAB_SIZE, m + SLAB_SIZE - p);
+#endif
+    return (slab*)p;
+}
+
+static void unmap_slab(slab *s)
+{
+#ifdef _WIN32
+    VirtualFree(s, 0, MEM_RELEASE);
+#else
+    munmap(s, SLAB_SIZE);
+#endif
+}
+
+// lock held
+static void depot_link(size_t idx, void *batch, size_t len)
+{
+    next_batch(batch) = g_depot.batches[idx];
+    batch_len(batch) = len;
+    g_depot.batches[idx] = batch;
+    g_depot.free_bytes += len * class_size(idx);
+}
+
+// lock held, cuts chain into batches for the depot
+static void depot_link_chain(size_t idx, void *chain)
+{
+    size_t n = batch_size(idx);
+    while (chain)
+    {
+        void *first = chain;
+        void *last = chain;
+        size_t len = 1;
+        while (len < n && next_block(last))
+        {
+            last = next_block(last);
+            len++;
+        }
+        chain = next_block(last);
+        next_block(last) = NULL;
+        depot_link(idx, first, len);
+    }
+}
+
+// lock held, unmaps the pages whose blocks are all in the depot
+static size_t depot_trim()
+{
+    size_t released = 0;
+    for (size_t idx = 0; idx < POOL_CLASSES; idx++)
+    {
+        if (!g_depot.batches[idx])
+        {
+            continue;
+        }
+        slab *s;
+        for (s = g_depot.slabs[idx]; s; s = s->next)
+        {
+            s->unused = 0;
+        }
+        void *b;
+        void *p;
+        for (b = g_depot.batches[idx]; b; b = next_batch(b))
+        {
+            for (p = b; p; p = next_block(p))
+            {
+                slab_of(p)->unused++;
+            }
+        }
+        bool any = false;
+        for (s = g_depot.slabs[idx]; s; s = s->next)
+        {
+            any = any || s->unused == s->capacity;
+        }
+        if (!any)
+        {
+            continue;
+        }
+
+        // keep the blocks of pages still in use, drop the rest
+        void *keep = NULL;
+        size_t blocks = 0;
+        b = g_depot.batches[idx];
+        while (b)
+        {
+            void *nb = next_batch(b);
+            p = b;
+            while (p)
+            {
+                void *np = next_block(p);
+                if (slab_of(p)->unused != slab_of(p)->capacity)
+                {
+                    next_block(p) = keep;
+                    keep = p;
+                }
+                blocks++;
+                p = np;
+            }
+            b = nb;
+        }
+        g_depot.batches[idx] = NULL;
+        g_depot.free_bytes -= blocks * class_size(idx);
+        depot_link_chain(idx, keep);
+
+        slab **link = &g_depot.slabs[idx];
+        while ((s = *link) != NULL)
+        {
+            if (s->unused == s->capacity)
+            {
+                *link = s->next;
+                unmap_slab(s);
+                released += SLAB_SIZE;
+            }
+            else
+            {
+                link = &s->next;
+            }
+        }
+    }
+    // pages held by live blocks cannot go, wait for real growth before
+    // walking the depot again
+    g_depot.trim_at = g_depot.free_bytes > g_depot.retention ? g_depot.free_bytes * 2 : g_depot.retention;
+    return released;
+}
+
+static void depot_push(size_t idx, void *batch, size_t len)
+{
+    pool_lock(&g_depot.lock);
+    depot_link(idx, batch, len);
+    if (g_depot.free_bytes > g_depot.trim_at)
+    {
+        depot_trim();
+    }
+    pool_unlock(&g_depot.lock);
+}
+
+static void cache_flush(free_list &l, size_t idx)
+{
+    size_t n = batch_size(idx);
+    void *first = l.head;
+    void *last = first;
+    for (size_t i = 1; i < n; i++)
+    {
+        last = next_block(last);
+    }
+    l.head = next_block(last);
+    l.count -= n;
+    next_block(last) = NULL;
+    depot_push(idx, first, n);
+}
+
+// hands every block of c back to the depot
+static void drain_cache(thread_cache *c)
+{
+    pool_lock(&g_depot.lock);
+    for (size_t i = 0; i < POOL_CLASSES; i++)
+    {
+        depot_link_chain(i, c->lists[i].head);
+        c->lists[i].head = NULL;
+        c->lists[i].count = 0;
+    }
+    pool_unlock(&g_depot.lock);
+}
+
+#ifdef _WIN32
+static void WINAPI thread_exit(void *p)
+#else
+static void thread_exit(void *p)
+#endif
+{
+    if (p)
+    {
+        t_cache = NULL;
+        drain_cache((thread_cache*)p);
+        free(p);
+    }
+}
+
+// the bound cache is handed back to the depot when the thread exits
+static void bind_cache(thread_cache *c)
+{
+#ifdef _WIN32
+    FlsSetValue(g_depot.key, c);
+#else
+    pthread_setspecific(g_depot.key, c);
+#endif
+}
+
+static thread_cache *create_cache()
+{
+    pool_lock(&g_depot.lock);
+    bool closed = g_depot.closed;
+    if (!closed && !g_depot.key_created)
+    {
+#ifdef _WIN32
+        g_depot.key = FlsAlloc(thread_exit);
+#else
+        pthread_key_create(&g_depot.key, thread_exit);
+#endif
+        g_depot.key_created = true;
+    }
+    pool_unlock(&g_depot.lock);
+    if (closed)
+    {
+        return NULL;
+    }
+
+    thread_cache *c = (thread_cache*)calloc(1, sizeof(thread_cache));
+    if (!c)
+    {
+        throw std::bad_alloc();
+    }
+    bind_cache(c);
+    t_cache = c;
+    return c;
+}
+
+// carves a fresh page, returns its block chain
+static void *new_slab(size_t idx, size_t &count)
+{
+    slab *s = map_slab();
+    size_t size = class_size(idx);
+    s->capacity = (SLAB_SIZE - SLAB_HEADER) / size;
+    char *first = (char*)s + SLAB_HEADER;
+    for (size_t i = 0; i + 1 < s->capacity; i++)
+    {
+        next_block(first + i * size) = first + (i + 1) * size;
+    }
+    next_block(first + (s->capacity - 1) * size) = NULL;
+
+    pool_lock(&g_depot.lock);
+    s->next = g_depot.slabs[idx];
+    g_depot.slabs[idx] = s;
+    pool_unlock(&g_depot.lock);
+    count = s->capacity;
+    return first;
+}
+
+static void *cache_refill(free_list &l, size_t idx)
+{
+    pool_lock(&g_depot.lock);
+    void *batch = g_depot.batches[idx];
+    size_t len = 0;
+    if (batch)
+    {
+        len = batch_len(batch);
+        g_depot.batches[idx] = next_batch(batch);
+        g_depot.free_bytes -= len * class_size(idx);
+    }
+    pool_unlock(&g_depot.lock);
+
+    if (!batch)
+    {
+        // one batch for this cache, the rest of the page for the depot
+        batch = new_slab(idx, len);
+        void *last = batch;
+        size_t n = batch_size(idx);
+        if (len > n)
+        {
+            for (size_t i = 1; i < n; i++)
+            {
+                last = next_block(last);
+            }
+            void *rest = next_block(last);
+            next_block(last) = NULL;
+            len = n;
+            pool_lock(&g_depot.lock);
+            depot_link_chain(idx, rest);
+            pool_unlock(&g_depot.lock);
+        }
+    }
+    l.head = next_block(batch);
+    l.count = len - 1;
+    return batch;
+}
+
+// at exit only pages whose blocks are all free are given back. Values
+// destroyed later, globals of other translation units included, still
+// find their blocks mapped and simply leave them
+static struct mem_pool_init_util
+{
+    ~mem_pool_init_util()
+    {
+        if (t_cache)
+        {
+            bind_cache(NULL);
+            thread_exit(t_cache);
+        }
+        pool_lock(&g_depot.lock);
+        g_depot.closed = true;
+        depot_trim();
+        pool_unlock(&g_depot.lock);
+    }
+}g_initutil;
+
+void *tjson::internal::jsmalloc( size_t s )
+{
+    size_t idx = pool_class(s);
+    thread_cache *c = t_cache;
+    if (idx >= POOL_CLASSES || (!c && !(c = create_cache())))
+    {
+        void *p = malloc(s);
+        if (!p)
+        {
+            throw std::bad_alloc();
+        }
+        return p;
+    }
+
+    free_list &l = c->lists[idx];
+    void *p = l.head;
+    if (p)
+    {
+        l.head = next_block(p);
+        l.count--;
+        return p;
+    }
+    return cache_refill(l, idx);
+}
+
+void internal::jsfree( void *p, size_t s )
+{
+    if (!p)
+    {
+        return;
+    }
+    size_t idx = pool_class(s);
+    if (idx >= POOL_CLASSES)
+    {
+        free(p);
+        return;
+    }
+
+    // after the pool is torn down at exit blocks are simply left alone
+    thread_cache *c = t_cache;
+    if (!c && !(c = create_cache()))
+    {
+        return;
+    }
+    free_list &l = c->lists[idx];
+    next_block(p) = l.head;
+    l.head = p;
+    if (++l.count >= 2 * batch_size(idx))
+    {
+        cache_flush(l, idx);
+    }
+}
+
+void tjson::set_memory_retention(size_t bytes)
+{
+    pool_lock(&g_depot.lock);
+    g_depot.retention = bytes;
+    g_depot.trim_at = bytes;
+    if (g_depot.free_bytes > g_depot.trim_at)
+    {
+        depot_trim();
+    }
+    pool_unlock(&g_depot.lock);
+}
+
+size_t tjson::trim_memory()
+{
+    // the calling thread's blocks go back first so their pages can go too
+    if (t_cache)
+    {
+        drain_cache(t_cache);
+    }
+    pool_lock(&g_depot.lock);
+    size_t released = depot_trim();
+    pool_unlock(&g_depot.lock);
+    return released;
+}
+
+internal::Arena::~Arena()
+{
+    while (m_head)
+    {
+        chunk *next = m_head->next;
+        free_chunk(m_head);
+        m_head = next;
+    }
+}
+
+internal::Arena::chunk *internal::Arena::new_chunk(size_t size)
+{
+    chunk *c = (chunk*)(m_upstream ? m_upstream->allocate(sizeof(chunk) + size) : malloc(sizeof(chunk) + size));
+    if (!c)
+    {
+        throw std::bad_alloc();
+    }
+    c->size = size;
+    return c;
+}
+
+void internal::Arena::free_chunk(chunk *c)
+{
+    if (m_upstream)
+    {
+        m_upstream->deallocate(c, sizeof(chunk) + c->size);
+    }
+    else
+    {
+        free(c);
+    }
+}
+
+void *internal::Arena::alloc_chunk(size_t s)
+{
+    size_t size = ARENA_CHUNK_SIZE;
+    if (m_head)
+    {
+        size = m_head->size < ARENA_MAX_CHUNK ? m_head->size * 2 : m_head->size;
+    }
+    if (s > size / 4)
+    {
+        // a big block gets a chunk of its own behind the current one, so the
+        // space left in the current chunk is not lost
+        chunk *c = new_chunk(s);
+        c->used = s;
+        if (m_head)
+        {
+            c->next = m_head->next;
+            m_head->next = c;
+        }
+        else
+        {
+            c->next = NULL;
+            m_head = c;
+        }
+        return c + 1;
+    }
+
+    chunk *c = new_chunk(size);
+    c->next = m_head;
+    c->used = s;
+    m_head = c;
+    return c + 1;
+}
+
+size_t internal::Arena::used() const
+{
+    size_t s = 0;
+    for (chunk *c = m_head; c; c = c->next)
+    {
+        s += c->used;
+    }
+    return s;
+}
+
+size_t internal::Arena::reserved() const
+{
+    size_t s = 0;
+    for (chunk *c = m_head; c; c = c->next)
+    {
+        s += sizeof(chunk) + c->size;
+    }
+    return s;
+}
+
+void internal::Arena::clear()
+{
+    chunk *keep = NULL;
+    while (m_head)
+    {
+        chunk *next = m_head->next;
+        if (!keep || m_head->size > keep->size)
+        {
+            if (keep)
+            {
+                free_chunk(keep);
+            }
+            keep = m_head;
+        }
+        else
+        {
+            free_chunk(m_head);
+        }
+        m_head = next;
+    }
+    if (keep)
+    {
+        keep->next = NULL;
+        keep->used = 0;
+    }
+    m_head = keep;
+}
+
+void tjson::Value::internal_build_string( const char *s, size_t l, bool borrow, Allocator *a )
+{
+    assert(tag() == JT_NULL);
+    if (a ? l <= SMALL_MAX && fits_hint(a) : l <= SHORT_MAX)
+    {
+        // copied even when borrowing is allowed, and zero padded so short
+        // strings compare as plain bytes
+        memset(m_short, 0, sizeof(m_short));
+        memcpy(m_short, s, l);
+        if (a)
+        {
+            m_short[SMALL_MAX] = (char)(SMALL_MAX - l);
+            m_short[SHORT_MAX] = SMALL;
+        }
+        else
+        {
+            m_short[SHORT_MAX] = (char)(SHORT_MAX - l);
+        }
+        set_tag(SHORT_STRING);
+        set_hint(a);
+        return;
+    }
+    m_strval = StringData::create(s, l, borrow, a);
+    set_tag(JT_STRING);
+}
+
+void tjson::Value::internal_build_key( const char *k, size_t l, bool borrow, Allocator *a, KeyTable *keys )
+{
+    if (keys && l > SHORT_MAX)
+    {
+        assert(tag() == JT_NULL);
+        m_strval = keys->internal_find_or_add(k, l);
+        set_tag(JT_STRING);
+        return;
+    }
+    // keys are compared as they are, so short ones never hold an allocator
+    internal_build_string(k, l, borrow, l <= SHORT_MAX ? NULL : a);
+}
+
+void tjson::Value::internal_build_object( Allocator *a )
+{
+    assert(tag() == JT_NULL);
+    m_dict = a ? MapData::create(a, 0) : NULL;
+    set_tag(JT_OBJECT);
+}
+
+void tjson::Value::internal_build_array( Allocator *a )
+{
+    assert(tag() == JT_NULL);
+    m_array = a ? VectorData::create(a, 0) : NULL;
+    set_tag(JT_ARRAY);
+}
+
+void tjson::Value::internal_build_bool( bool v )
+{
+    assert(tag() == JT_NULL);
+    m_intval = 0;
+    m_bool = v;
+    set_tag(JT_BOOL);
+}
+
+void tjson::Value::internal_build_float( const char *s )
+{
+    assert(tag() == JT_NULL);
+    m_fval = jsstrtod(s, NULL); //strtod(s, NULL);
+    set_tag(JT_DOUBLE);
+}
+
+void tjson::Value::internal_build_integer( const char *s )
+{
+    assert(tag() == JT_NULL);
+    m_intval = fs2i(s);// strtoll(s, NULL, 10);
+    set_tag(JT_INTEGER);
+}
+
+Value *tjson::Value::internal_add_key( const char *k, size_t l, bool borrow, DuplicateKeys dup, KeyTable *keys )
+{
+    assert(tag() == JT_OBJECT);
+    if (!m_dict)
+    {
+        m_dict = MapData::create(NULL, MAP_INIT_SIZE);
+    }
+    if (dup == JD_KEEP_ALL || dup == JD_FIRST_WINS)
+    {
+        return &m_dict->append(k, l, borrow, keys);
+    }
+    size_t n = m_dict->size();
+    Value *v = &m_dict->get(k, l, borrow, keys);
+    if (m_dict->size() == n)
+    {
+        if (dup == JD_ERROR)
+        {
+            return NULL;
+        }
+        v->destroy();
+    }
+    return v;
+}
+
+void tjson::Value::internal_end_object( DuplicateKeys dup )
+{
+    assert(tag() == JT_OBJECT);
+    if (dup == JD_FIRST_WINS && m_dict)
+    {
+        m_dict->drop_repeats();
+    }
+}
+
+Value *tjson::Value::internal_add()
+{
+    assert(tag() == JT_ARRAY);
+    if (!m_array)
+    {
+        m_array = VectorData::create(NULL, ARRAY_INIT_SIZE);
+    }
+    return m_array->push_back();
+}
+
+void tjson::Value::internal_take_array( Value *items, size_t n, Allocator *a )
+{
+    assert(tag() == JT_NULL);
+    m_array = NULL;
+    if (n || a)
+    {
+        m_array = VectorData::create(a, n);
+        if (n)
+        {
+            memcpy((void*)m_array->buff, items, sizeof(Value) * n);
+            m_array->value_size = n;
+        }
+    }
+    set_tag(JT_ARRAY);
+}
+
+size_t tjson::Value::internal_take_object( Value *keys, Value *values, size_t n, Allocator *a, DuplicateKeys dup )
+{
+    assert(tag() == JT_NULL);
+    m_dict = NULL;
+    size_t taken = n;
+    if (n || a)
+    {
+        m_dict = MapData::create(a, n);
+        taken = m_dict->take(keys, values, n, dup);
+    }
+    set_tag(JT_OBJECT);
+    return taken;
+}
+
+size_t tjson::Value::memory_usage() const
+{
+    switch (tag())
+    {
+    case JT_ARRAY:
+        return m_array ? m_array->memory_usage() : 0;
+    case JT_OBJECT:
+        return m_dict ? m_dict->memory_usage() : 0;
+    case JT_STRING:
+        return m_strval->interned ? 0 : m_strval->memory_usage();
+    default:
+        return 0;
+    }
+}
+
+// moves buff to a larger block, the one allocated with the header stays
+template <class T>
+static void set_capacity(T *&buff, size_t &capacity, size_t size, const void *inline_buff, Allocator *alloc, size_t new_capacity)
+{
+    T *newValues = (T *)jsmalloc(alloc, sizeof(T) * new_capacity);
+    memcpy((void*)newValues, buff, sizeof(T) * size); // direct copy memory!
+    if (buff != inline_buff)
+    {
+        jsfree(alloc, buff, sizeof(T) * capacity); // no desconstruct!
+    }
+    buff = newValues;    
+    capacity = new_capacity;
+}
+
+template <class T>
+static void increase_capacity(T *&buff, size_t &capacity, size_t size, const void *inline_buff, Allocator *alloc, size_t init_size)
+{
+    set_capacity(buff, capacity, size, inline_buff, alloc, size ? size * 2 + 1 : init_size);
+}
+
+tjson::internal::VectorData *tjson::internal::VectorData::create(Allocator *a, size_t capacity)
+{
+    VectorData *d = (VectorData*)jsmalloc(a, sizeof(VectorData) + sizeof(Value) * capacity);
+    d->ref = 1;
+    d->allocator = a;
+    d->buff = (Value*)(d + 1);
+    d->value_size = 0;
+    d->buff_capacity = capacity;
+    d->inline_capacity = capacity;
+    return d;
+}
+
+void tjson::internal::VectorData::destroy(VectorData *d)
+{
+    for (size_t i = 0; i < d->value_size; i++)
+    {
+        d->buff[i].~Value();
+    }
+    if (d->buff != (Value*)(d + 1))
+    {
+        jsfree(d->allocator, d->buff, sizeof(Value) * d->buff_capacity);
+    }
+    jsfree(d->allocator, d, sizeof(VectorData) + sizeof(Value) * d->inline_capacity);
+}
+
+void tjson::internal::VectorData::grow()
+{
+    increase_capacity(buff, buff_capacity, value_size, this + 1, allocator, ARRAY_INIT_SIZE);
+}
+
+void tjson::internal::VectorData::reserve(size_t n)
+{
+    if (n > buff_capacity)
+    {
+        set_capacity(buff, buff_capacity, value_size, this + 1, allocator, n);
+    }
+}
+
+bool tjson::internal::VectorData::erase(size_t pos)
+{
+    if (pos >= value_size)
+    {
+        return false;
+    }
+    buff[pos].~Value();
+    memmove((void*)&buff[pos], &buff[pos + 1], sizeof(Value) * (value_size - pos - 1));
+    value_size--;
+    return true;
+}
+
+size_t tjson::internal::VectorData::memory_usage() const
+{
+    size_t s = sizeof(VectorData) + sizeof(Value) * inline_capacity;
+    if (buff != (const Value*)(this + 1))
+    {
+        s += sizeof(Value) * buff_capacity;
+    }
+    for (size_t i = 0; i < value_size; i++)
+    {
+        s += buff[i].memory_usage();
+    }
+    return s;
+}
+
+tjson::internal::StringData *tjson::internal::StringData::create(const char *s, size_t len, bool borrow, Allocator *a)
+{
+    StringData *d = (StringData*)jsmalloc(a, sizeof(StringData) + (borrow ? 0 : len + 1));
+    d->allocator = a;
+    d->value_size = len;
+    d->hash = 0;
+    d->borrowed = borrow;
+    d->interned = false;
+    if (borrow)
+    {
+        d->buff = const_cast<char*>(s);
+        return d;
+    }
+    d->buff = (char*)(d + 1);
+    memcpy(d->buff, s, len);
+    d->buff[len] = 0;
+    return d;
+}
+
+void tjson::internal::StringData::destroy(StringData *d)
+{
+    if (!d->interned)
+    {
+        jsfree(d->allocator, d, d->memory_usage());
+    }
+}
+
+size_t internal::StringData::memory_usage() const
+{
+    return sizeof(StringData) + (borrowed ? 0 : value_size + 1);
+}
+
+const tjson::Value &tjson::Value::operator[](const char *k) const
+{
+    if (tag() == JT_OBJECT && m_dict)
+    {
+        return m_dict->find(k, strlen(k));
+    }
+    return Null;
+}
+
+tjson::Value &tjson::Value::operator[](const char *k)
+{
+    if (tag() == JT_OBJECT)
+    {
+        if (!m_dict)
+        {
+            m_dict = MapData::create(NULL, MAP_INIT_SIZE);
+        }
+        return m_dict->get(k, strlen(k)).slot_in(m_dict->allocator);
+    }
+    static Value dummy;
+    return dummy;
+}
+
+const tjson::Value &tjson::Value::operator[](const Key &k) const
+{
+    if (tag() == JT_OBJECT && m_dict)
+    {
+        return m_dict->find(k);
+    }
+    return Null;
+}
+
+tjson::Value &tjson::Value::operator[](const Key &k)
+{
+    if (tag() == JT_OBJECT)
+    {
+        if (!m_dict)
+        {
+            m_dict = MapData::create(NULL, MAP_INIT_SIZE);
+        }
+        return m_dict->get(k).slot_in(m_dict->allocator);
+    }
+    static Value dummy;
+    return dummy;
+}
+
+const tjson::Value *tjson::Value::find(const char *k) const
+{
+    const Value *v = &(*this)[k];
+    return v == &Null ? NULL : v;
+}
+
+const tjson::Value *tjson::Value::find(const Key &k) const
+{
+    const Value *v = &(*this)[k];
+    return v == &Null ? NULL : v;
+}
+
+Allocator *tjson::Value::allocator() const
+{
+    switch (tag())
+    {
+    case JT_STRING:
+        return m_strval->allocator;
+    case JT_ARRAY:
+        return m_array ? m_array->allocator : NULL;
+    case JT_OBJECT:
+        return m_dict ? m_dict->allocator : NULL;
+    default:
+        return hint();
+    }
+}
+
+// the children of a container come from its allocator, so one that does
+// already is left as it is. Pool values may share memory with anything
+void tjson::Value::adopt( Allocator *a )
+{
+    if (!a)
+    {
+        return;
+    }
+    switch (tag())
+    {
+    case SHORT_STRING:
+        if (m_short[SHORT_MAX] != SMALL || !fits_hint(a))
+        {
+            char s[SHORT_MAX];
+            size_t l = string_size();
+            memcpy(s, m_short, l);
+            make_null();
+            internal_build_string(s, l, false, a);
+        }
+        else
+        {
+            set_hint(a);
+        }
+        break;
+    case JT_STRING:
+        if (m_strval->allocator != a)
+        {
+            StringData *d = StringData::create(m_strval->buff, m_strval->size(), false, a);
+            StringData::destroy(m_strval);
+            m_strval = d;
+        }
+        break;
+    case JT_ARRAY:
+        if (!m_array || m_array->allocator != a)
+        {
+            size_t n = m_array ? m_array->size() : 0;
+            VectorData *d = VectorData::create(a, n);
+            for (size_t i = 0; i < n; i++)
+            {
+                Value *v = d->push_back();
+                v->assign(m_array->buff[i]);
+                v->adopt(a);
+            }
+            delete_data(m_array);
+            m_array = d;
+        }
+        break;
+    case JT_OBJECT:
+        if (!m_dict || m_dict->allocator != a)
+        {
+            size_t n = m_dict ? m_dict->size() : 0;
+            MapData *d = MapData::create(a, n);
+            for (size_t i = 0; i < n; i++)
+            {
+                const Value &key = m_dict->buff[i].key;
+                Value &v = d->append(key.asCString(), key.string_size());
+                v.assign(m_dict->buff[i].value);
+                v.adopt(a);
+            }
+            delete_data(m_dict);
+            m_dict = d;
+        }
+        break;
+    default:
+        set_hint(a);
+        break;
+    }
+}
+
+bool tjson::Value::become( Type t )
+{
+    if (tag() == JT_NULL)
+    {
+        Allocator *a = hint();
+        if (t == JT_ARRAY)
+        {
+            internal_build_array(a);
+        }
+        else
+        {
+            internal_build_object(a);
+        }
     }
+    return tag() == t;
+}
+
+void tjson::Value::makeArray( size_t capacity )
+{
+    Allocator *a = allocator();
+    Value tmp;
+    tmp.internal_build_array();
+    tmp.m_array = capacity || a ? VectorData::create(a, capacity) : NULL;
+    swap(tmp);
+}
 
-    if (g_mem_list[pool_idx].empty())
+void tjson::Value::makeObject( size_t capacity )
+{
+    Allocator *a = allocator();
+    Value tmp;
+    tmp.internal_build_object();
+    tmp.m_dict = capacity || a ? MapData::create(a, capacity) : NULL;
+    if (tmp.m_dict)
     {
-#if DEBUG_MEM
-        printf("%lu increase %d\n", pool_idx, pool_increase);        
-#endif
-        mem_pool_init_util::init_pool(pool_idx, pool_increase);
+        tmp.m_dict->reserve(capacity);
     }
-
-    void *p = g_mem_list[pool_idx].back();
-    g_mem_list[pool_idx].pop_back();
-#if DEBUG_MEM
-    g_memdgb_list[pool_idx]++;
-#endif
-    return p;
+    swap(tmp);
 }
 
-void internal::jsfree( void *p, size_t s )
+void tjson::Value::reserve( size_t n )
 {
-    size_t pool_idx = mem_align(s) / align_size - 1;      
-    if (pool_idx >= g_mem_list.size())
+    if (tag() == JT_ARRAY)
     {
-        free(p);
-        return;
+        if (!m_array)
+        {
+            m_array = VectorData::create(NULL, n);
+        }
+        m_array->reserve(n);
+    }
+    else if (tag() == JT_OBJECT)
+    {
+        if (!m_dict)
+        {
+            m_dict = MapData::create(NULL, n);
+        }
+        m_dict->reserve(n);
     }
+}
 
-    g_mem_list[pool_idx].push_back(p);
-#if DEBUG_MEM
-    g_memdgb_list[pool_idx]--;
-#endif
+Value *tjson::Value::append_taken( Value &v )
+{
+    if (!become(JT_ARRAY))
+    {
+        return NULL;
+    }
+    if (m_array)
+    {
+        v.adopt(m_array->allocator);
+    }
+    Value *slot = internal_add();
+    slot->swap(v);
+    return &slot->slot_in(m_array->allocator);
 }
 
-void tjson::Value::internal_build_string( const char *s, size_t l )
+Value *tjson::Value::set_taken( const char *k, size_t len, const Key *key, Value &v )
 {
-    assert(m_type == JT_NULL);
-    assert(!m_strval);
-    m_type = JT_STRING;
-    m_strval = new String(s, l);
+    if (!become(JT_OBJECT))
+    {
+        return NULL;
+    }
+    if (!m_dict)
+    {
+        m_dict = MapData::create(NULL, MAP_INIT_SIZE);
+    }
+    v.adopt(m_dict->allocator);
+    Value &slot = key ? m_dict->get(*key) : m_dict->get(k, len);
+    slot.swap(v);
+    return &slot.slot_in(m_dict->allocator);
 }
 
-void tjson::Value::internal_build_object()
+// v may be a child of this value, it is copied before the container grows
+Value *tjson::Value::append( const Value &v )
 {
-    assert(m_type == JT_NULL);
-    assert(!m_dict);
-    m_type = JT_OBJECT;
-    m_dict = new Map;
+    Value tmp(v);
+    return append_taken(tmp);
 }
 
-void tjson::Value::internal_build_array()
+Value *tjson::Value::set( const char *k, const Value &v )
 {
-    assert(m_type == JT_NULL);
-    assert(!m_array);
-    m_type = JT_ARRAY;
-    m_array = new Vector;
+    Value tmp(v);
+    return set_taken(k, strlen(k), NULL, tmp);
 }
 
-void tjson::Value::internal_build_bool( bool v )
+Value *tjson::Value::set( const Key &k, const Value &v )
 {
-    assert(m_type == JT_NULL);
-    assert(m_intval == 0);
-    m_type = JT_BOOL;
-    m_bool = v;
+    Value tmp(v);
+    return set_taken(k.c_str(), k.size(), &k, tmp);
 }
 
-static double jsstrtod(const char *string, char **endPtr);
-void tjson::Value::internal_build_float( const char *s )
+#if TJSON_HAS_RVALUE_REFS
+Value *tjson::Value::append( Value &&v )
 {
-    assert(m_type == JT_NULL);
-    assert(m_intval == 0);
-    m_type = JT_DOUBLE;
-    m_fval = jsstrtod(s, NULL); //strtod(s, NULL);
+    Value tmp;
+    tmp.swap(v);
+    return append_taken(tmp);
 }
 
-static int64_t fs2i(const char* str);
-void tjson::Value::internal_build_integer( const char *s )
+Value *tjson::Value::set( const char *k, Value &&v )
 {
-    assert(m_type == JT_NULL);
-    assert(m_intval == 0);
-    m_type = JT_INTEGER;
-    m_intval = fs2i(s);// strtoll(s, NULL, 10);
+    Value tmp;
+    tmp.swap(v);
+    return set_taken(k, strlen(k), NULL, tmp);
 }
 
-Value *tjson::Value::internal_add_key( const char *k, size_t l)
+Value *tjson::Value::set( const Key &k, Value &&v )
 {
-    assert(m_type == JT_OBJECT);
-    assert(m_dict);
-    return &(*m_dict)[String(k,l)];
+    Value tmp;
+    tmp.swap(v);
+    return set_taken(k.c_str(), k.size(), &k, tmp);
 }
+#endif
 
-Value *tjson::Value::internal_add()
+bool tjson::Value::erase( size_t index )
 {
-    assert(m_type == JT_ARRAY);
-    assert(m_array);
-    Value *newV = m_array->push_back();
-    assert(newV);
-    return newV;
+    return tag() == JT_ARRAY && m_array && m_array->erase(index);
 }
 
-tjson::internal::VectorData::VectorData() 
-    :ref(1)
-    ,value_size(0)
-    ,buff_capacity(ARRAY_INIT_SIZE)
+bool tjson::Value::erase( const char *k )
 {
-    buff = (Value*)jsmalloc(sizeof(Value) * ARRAY_INIT_SIZE);
+    return tag() == JT_OBJECT && m_dict && m_dict->erase(k, strlen(k));
 }
 
-template <class T>
-static void increase_capacity(T *&buff, size_t &old_capacity, size_t &old_size)
+bool tjson::Value::erase( const Key &k )
 {
-    size_t new_capacity = old_size * 2 + 1;
-    T *newValues = (T *)jsmalloc(sizeof(T) * new_capacity);
-    memcpy(newValues, buff, sizeof(T) * old_size); // direct copy memory!
-    jsfree(buff, sizeof(T) * old_capacity); // no desconstruct!        
-    buff = newValues;    
-    old_capacity = new_capacity;
+    return tag() == JT_OBJECT && m_dict && m_dict->erase(k);
 }
 
-void tjson::internal::VectorData::increase_size()
+void tjson::Value::destroy()
 {
-    if (value_size + 1 > buff_capacity)
+    switch (tag())
     {
-        increase_capacity(buff, buff_capacity, value_size);
+    case JT_ARRAY:
+        delete_data(m_array);
+        break;
+    case JT_OBJECT:
+        delete_data(m_dict);
+        break;
+    case JT_STRING:
+        StringData::destroy(m_strval);
+        break;
+    default:
+        break;
     }
-    ::new(&buff[value_size++]) Value;
+    make_null();
 }
 
-tjson::Value &tjson::internal::MapData::operator[](const tjson::internal::String &key)
+void tjson::Value::assign( const Value &v )
 {
-    for (size_t i = 0; i < value_size; i++)
+    using namespace internal;    
+    switch (v.tag())
     {
-        String &pair_key = buff[i].key;
-        if (key.size() == pair_key.size() &&
-            memcmp(key.c_str(), pair_key.c_str(), key.size()) == 0)
+    case JT_ARRAY:            
+        // containers are shared between copies
+        memcpy(m_short, v.m_short, sizeof(m_short));
+        if (m_array)
+        {
+            m_array->ref++;
+        }
+        break;
+    case JT_OBJECT:    
+        memcpy(m_short, v.m_short, sizeof(m_short));
+        if (m_dict)
         {
-            return buff[i].value;
+            m_dict->ref++;
         }
+        break;
+    case JT_STRING:     
+        assert(v.m_strval);
+        make_null();
+        internal_build_string(v.m_strval->buff, v.m_strval->size());
+        break;
+    default:
+        // scalars and inline strings, without the allocator of v's
+        // container
+        memcpy(m_short, v.m_short, sizeof(m_short));
+        set_hint(NULL);
+        break;
     }
+}
 
-    if (value_size + 1 > buff_capacity)
+Value & tjson::Value::operator=( const Value &v )
+{
+    if (this == &v)
     {
-        increase_capacity(buff, buff_capacity, value_size);
+        return *this;
     }
 
-    ::new(&buff[value_size].key) String(key);
-    ::new(&buff[value_size].value) Value;
-    return buff[value_size++].value;
+    // v may sit somewhere below this value, take the copy first. It goes
+    // where what it replaces came from
+    Value tmp(v);
+    tmp.adopt(allocator());
+    destroy();
+    memcpy(m_short, tmp.m_short, sizeof(m_short));
+    tmp.set_tag(JT_NULL);
+    return *this;
 }
 
-tjson::internal::VectorData::~VectorData()
+#if TJSON_HAS_RVALUE_REFS
+Value & tjson::Value::operator=( Value &&v )
 {
-    assert(ref == 0);
-    for (size_t i = 0; i < value_size; i++)
+    if (this == &v)
     {
-        buff[i].~Value();
+        return *this;
     }
-    jsfree(buff, sizeof(Value) * buff_capacity);
+
+    // v may sit somewhere below this value, take it out first
+    Value tmp;
+    tmp.swap(v);
+    tmp.adopt(allocator());
+    destroy();
+    memcpy(m_short, tmp.m_short, sizeof(m_short));
+    tmp.set_tag(JT_NULL);
+    return *this;
+}
+#endif
+
+tjson::internal::MapData *tjson::internal::MapData::create(Allocator *a, size_t capacity)
+{
+    MapData *d = (MapData*)jsmalloc(a, sizeof(MapData) + sizeof(pair) * capacity);
+    d->ref = 1;
+    d->allocator = a;
+    d->buff = (pair*)(d + 1);
+    d->value_size = 0;
+    d->buff_capacity = capacity;
+    d->inline_capacity = capacity;
+    d->index = NULL;
+    d->index_capacity = 0;
+    return d;
 }
 
-internal::StringData &internal::StringData::operator=( const char *s )
+void tjson::internal::MapData::destroy(MapData *d)
 {
-    size_t newsize = strlen(s);
-    if (newsize + 1 > buff_capacity)
+    for (size_t i = 0; i < d->value_size; i++)
+    {
+        d->buff[i].~pair();
+    }
+    if (d->buff != (pair*)(d + 1))
+    {
+        jsfree(d->allocator, d->buff, sizeof(pair) * d->buff_capacity);
+    }
+    if (d->index)
     {
-        size_t newcap = newsize * 2 + 1;
+        jsfree(d->allocator, d->index, sizeof(slot) * d->index_capacity);
+    }
+    jsfree(d->allocator, d, sizeof(MapData) + sizeof(pair) * d->inline_capacity);
+}
 
-        char *newValues = (char *)jsmalloc(newcap);
-        memcpy(newValues, s, newsize);
-        newValues[newsize] = 0;
-        jsfree(buff, buff_capacity); 
+void tjson::internal::MapData::grow()
+{
+    increase_capacity(buff, buff_capacity, value_size, this + 1, allocator, MAP_INIT_SIZE);
+}
 
-        buff = newValues;
-        buff_capacity = newcap;        
+// shared is k interned, when it is. Keys interned in the same table are
+// equal only when they are the same string
+bool tjson::internal::MapData::same_key(const Value &key, const char *k, size_t len, const StringData *shared)
+{
+    if (key.tag() == Value::SHORT_STRING)
+    {
+        return len <= Value::SHORT_MAX && key.string_size() == len && memcmp(key.m_short, k, len) == 0;
     }
-    else
+    const StringData *d = key.m_strval;
+    if (shared && d->interned && d->allocator == shared->allocator)
     {
-        memcpy(buff, s, newsize);
-        buff[newsize] = 0;
+        return d == shared;
     }
-    value_size = newsize;
-
-    return *this;
+    return d->size() == len && memcmp(d->buff, k, len) == 0;
 }
 
-tjson::internal::StringData::StringData() 
-    :ref(1)
-    ,value_size(0)
-    ,buff_capacity(STRING_INIT_SIZE)
+tjson::internal::StringData *tjson::internal::MapData::interned_of(const Value &key)
 {
-    buff = (char *)jsmalloc(STRING_INIT_SIZE);
+    return key.tag() == JT_STRING && key.m_strval->interned ? key.m_strval : NULL;
 }
 
-void internal::StringData::assign( const char *s, size_t len )
+// position of k, or value_size when it is missing. h is its hash when
+// the map has an index
+size_t tjson::internal::MapData::index_of(const char *k, size_t len, unsigned int h, const StringData *shared) const
 {
-    if (len + 1 > buff_capacity)
+    if (index)
     {
-        size_t new_capacity = len + 1;
-        jsfree(buff, buff_capacity); 
-        buff = (char *)jsmalloc(new_capacity);
-        buff_capacity = new_capacity;
+        for (size_t i = slot_of(h, index_capacity); index[i].pos; i = (i + 1) & (index_capacity - 1))
+        {
+            size_t pos = index[i].pos - 1;
+            if (index[i].hash == h && same_key(buff[pos].key, k, len, shared))
+            {
+                return pos;
+            }
+        }
+        return value_size;
     }
-
-    value_size = len;
-    memcpy(buff, s, len);
-    buff[len] = 0;        
+    if (len <= Value::SHORT_MAX)
+    {
+        // inline keys are zero padded, equal keys are equal bytes
+        Value probe;
+        probe.internal_build_string(k, len);
+        for (size_t i = 0; i < value_size; i++)
+        {
+            if (memcmp(buff[i].key.m_short, probe.m_short, sizeof(probe.m_short)) == 0)
+            {
+                return i;
+            }
+        }
+        return value_size;
+    }
+    for (size_t i = 0; i < value_size; i++)
+    {
+        const Value &key = buff[i].key;
+        if (key.tag() == JT_STRING && same_key(key, k, len, shared))
+        {
+            return i;
+        }
+    }
+    return value_size;
 }
 
+// indexes pair pos, the table stays at most half full
+void tjson::internal::MapData::index_insert(size_t pos, unsigned int h)
+{
+    if ((pos + 1) * 2 > index_capacity)
+    {
+        rehash(index_capacity * 2);
+    }
+    size_t i = slot_of(h, index_capacity);
+    while (index[i].pos)
+    {
+        i = (i + 1) & (index_capacity - 1);
+    }
+    index[i].pos = (unsigned int)(pos + 1);
+    index[i].hash = h;
+}
 
-bool internal::String::operator<( const String &r ) const
+// builds the index at the given size, from the old one or from the keys
+void tjson::internal::MapData::rehash(size_t capacity)
 {
-    if (m_data)
+    slot *old = index;
+    size_t old_capacity = index_capacity;
+    index = (slot*)jsmalloc(allocator, sizeof(slot) * capacity);
+    memset(index, 0, sizeof(slot) * capacity);
+    index_capacity = capacity;
+    if (old)
     {
-        if (r.m_data)
+        // walking from the start of a cluster keeps equal keys in the
+        // order they were added, so lookups still find the first of them
+        size_t start = 0;
+        while (old[start].pos)
         {
-            return strcmp(m_data->buff, r.m_data->buff) < 0;
+            start++;
         }
-        return false;
+        for (size_t n = 0; n < old_capacity; n++)
+        {
+            size_t i = (start + n) & (old_capacity - 1);
+            if (old[i].pos)
+            {
+                size_t j = slot_of(old[i].hash, capacity);
+                while (index[j].pos)
+                {
+                    j = (j + 1) & (capacity - 1);
+                }
+                index[j] = old[i];
+            }
+        }
+        jsfree(allocator, old, sizeof(slot) * old_capacity);
+        return;
     }
-    else
+    for (size_t i = 0; i < value_size; i++)
     {
-        return r.m_data != NULL;
+        const Value &key = buff[i].key;
+        const StringData *shared = interned_of(key);
+        index_insert(i, shared ? shared->hash : hash_key(key.asCString(), key.string_size()));
     }
 }
 
-bool internal::String::operator==( const String &s ) const
+static size_t index_size_for(size_t n)
 {
-    if (size() != s.size())
+    size_t capacity = MAP_INDEX_MIN * 2;
+    while (capacity < n * 2)
     {
-        return false;
+        capacity *= 2;
     }
-    return strcmp(c_str(), s.c_str()) == 0;
+    return capacity;
 }
 
-const tjson::Value &tjson::Value::operator[](const char *k) const
+const Value &tjson::internal::MapData::find(const char *k, size_t len) const
+{
+    size_t i = index_of(k, len, index ? hash_key(k, len) : 0);
+    return i < value_size ? buff[i].value : Value::Null;
+}
+
+const Value &tjson::internal::MapData::find(const Key &k) const
 {
-    if (m_type == JT_OBJECT)
+    size_t i = index_of(k.c_str(), k.size(), k.hash());
+    return i < value_size ? buff[i].value : Value::Null;
+}
+
+tjson::Value &tjson::internal::MapData::get(const Key &k)
+{
+    size_t i = index_of(k.c_str(), k.size(), k.hash());
+    if (i < value_size)
     {
-        assert(m_dict);
-        return m_dict->find(String(k,strlen(k)));
+        return buff[i].value;
     }
-    return Null;
+    return add(k.c_str(), k.size(), false, k.hash(), NULL);
 }
 
-tjson::Value &tjson::Value::operator[](const char *k)
+tjson::Value &tjson::internal::MapData::get(const char *k, size_t len, bool borrow, KeyTable *keys)
 {
-    if (m_type == JT_OBJECT)
+    StringData *shared = NULL;
+    unsigned int h = 0;
+    if (keys && len > Value::SHORT_MAX)
     {
-        assert(m_dict);
-        return (*m_dict)[String(k,strlen(k))];
+        shared = keys->internal_find_or_add(k, len);
+        h = shared->hash;
     }
-    static Value dummy;
-    return dummy;
+    else if (index)
+    {
+        h = hash_key(k, len);
+    }
+    size_t i = index_of(k, len, h, shared);
+    if (i < value_size)
+    {
+        return buff[i].value;
+    }
+    return add(k, len, borrow, h, shared);
 }
 
-void tjson::Value::destroy()
+tjson::Value &tjson::internal::MapData::append(const char *k, size_t len, bool borrow, KeyTable *keys)
 {
-    switch (m_type)
+    if (keys && len > Value::SHORT_MAX)
     {
-    case JT_ARRAY:
-        assert(m_array);
-        delete m_array;
-        break;
-    case JT_OBJECT:
-        assert(m_dict);
-        delete m_dict;
-        break;
-    case JT_STRING:
-        assert(m_strval);
-        delete m_strval;
-        break;
-    default:
-        break;
+        StringData *shared = keys->internal_find_or_add(k, len);
+        return add(k, len, borrow, shared->hash, shared);
     }
-    m_type = JT_NULL;
-    m_intval = 0;
+    return add(k, len, borrow, index ? hash_key(k, len) : 0, NULL);
 }
 
-void tjson::Value::assign( const Value &v )
+tjson::Value &tjson::internal::MapData::add(const char *k, size_t len, bool borrow, unsigned int h, StringData *shared)
 {
-    using namespace internal;    
-    switch (v.m_type)
+    if (value_size == buff_capacity)
     {
-    case JT_ARRAY:            
-        internal_build_array();
-        *m_array = *v.m_array;
-        assert(m_array);
-        break;
-    case JT_OBJECT:    
-        assert(v.m_dict);
-        internal_build_object();        
-        *m_dict = *v.m_dict;
-        assert(m_dict);
-        break;
-    case JT_STRING:     
-        assert(v.m_strval);
-        internal_build_string(v.m_strval->c_str(), v.m_strval->size());
-        assert(m_strval);
-        break;
-    default:
-        m_intval = v.m_intval;
-        break;
+        grow();
+    }
+
+    // keys must live as long as the map, they come from its allocator
+    pair *p = &buff[value_size];
+    ::new(&p->key) Value;
+    if (shared)
+    {
+        p->key.m_strval = shared;
+        p->key.set_tag(JT_STRING);
+    }
+    else
+    {
+        p->key.internal_build_key(k, len, borrow, allocator, NULL);
+    }
+    ::new(&p->value) Value;
+    value_size++;
+    if (index)
+    {
+        index_insert(value_size - 1, h);
     }
-    m_type = v.m_type;
+    else if (value_size == MAP_INDEX_MIN)
+    {
+        rehash(index_size_for(value_size));
+    }
+    return p->value;
 }
 
-Value & tjson::Value::operator=( const Value &v )
+size_t tjson::internal::MapData::take(Value *keys, Value *values, size_t n, DuplicateKeys dup)
 {
-    if (this == &v)
+    if (n >= MAP_INDEX_MIN)
     {
-        return *this;
+        rehash(index_size_for(n));
     }
-
-    if (m_type == JT_STRING)
+    for (size_t i = 0; i < n; i++)
     {
-        if (m_strval == v.m_strval || m_strval->c_str() == v.m_strval->c_str())
+        const char *k = keys[i].asCString();
+        size_t len = keys[i].string_size();
+        const StringData *shared = interned_of(keys[i]);
+        unsigned int h = !index ? 0 : shared ? shared->hash : hash_key(k, len);
+        size_t j = dup == JD_KEEP_ALL ? value_size : index_of(k, len, h, shared);
+        if (j == value_size)
+        {
+            memcpy((void*)&buff[j].key, &keys[i], sizeof(Value));
+            memcpy((void*)&buff[j].value, &values[i], sizeof(Value));
+            value_size++;
+            if (index)
+            {
+                index_insert(j, h);
+            }
+            continue;
+        }
+        if (dup == JD_ERROR)
+        {
+            for (size_t r = i; r < n; r++)
+            {
+                keys[r].~Value();
+                values[r].~Value();
+            }
+            return i;
+        }
+        keys[i].~Value();
+        if (dup == JD_FIRST_WINS)
+        {
+            values[i].~Value();
+        }
+        else
         {
-            return *this;
+            buff[j].value.~Value();
+            memcpy((void*)&buff[j].value, &values[i], sizeof(Value));
         }
     }
-    else if (m_type == JT_ARRAY)
+    return n;
+}
+
+void tjson::internal::MapData::reserve(size_t n)
+{
+    if (n > buff_capacity)
+    {
+        set_capacity(buff, buff_capacity, value_size, this + 1, allocator, n);
+    }
+    if (n >= MAP_INDEX_MIN && index_capacity < index_size_for(n))
+    {
+        rehash(index_size_for(n));
+    }
+}
+
+bool tjson::internal::MapData::erase(const char *k, size_t len)
+{
+    return remove(index_of(k, len, index ? hash_key(k, len) : 0));
+}
+
+bool tjson::internal::MapData::erase(const Key &k)
+{
+    return remove(index_of(k.c_str(), k.size(), k.hash()));
+}
+
+bool tjson::internal::MapData::remove(size_t pos)
+{
+    if (pos >= value_size)
+    {
+        return false;
+    }
+    if (index)
+    {
+        unindex(pos);
+    }
+    buff[pos].~pair();
+    memmove((void*)&buff[pos], &buff[pos + 1], sizeof(pair) * (value_size - pos - 1));
+    value_size--;
+    return true;
+}
+
+// frees the slot of pair pos, shifting back the slots probed past it,
+// and renumbers the pairs after pos which are about to move down
+void tjson::internal::MapData::unindex(size_t pos)
+{
+    const Value &key = buff[pos].key;
+    const StringData *shared = interned_of(key);
+    unsigned int h = shared ? shared->hash : hash_key(key.asCString(), key.string_size());
+    size_t mask = index_capacity - 1;
+    size_t i = slot_of(h, index_capacity);
+    while (index[i].pos != pos + 1)
+    {
+        i = (i + 1) & mask;
+    }
+    for (size_t j = (i + 1) & mask; index[j].pos; j = (j + 1) & mask)
     {
-        if (m_array == v.m_array || m_array->m_data == v.m_array->m_data)
+        // a slot whose home lies cyclically in (i, j] is still reachable
+        size_t home = slot_of(index[j].hash, index_capacity);
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
         {
-            return *this;
+            continue;
         }
+        index[i] = index[j];
+        i = j;
     }
-    else if (m_type == JT_OBJECT)
+    index[i].pos = 0;
+    for (size_t j = 0; j < index_capacity; j++)
     {
-        if (m_dict == v.m_dict || m_dict->m_data == v.m_dict->m_data)
+        if (index[j].pos > pos + 1)
         {
-            return *this;
+            index[j].pos--;
         }
     }
+}
 
-    destroy();
-    assign(v);
-    return *this;
+void tjson::internal::MapData::drop_repeats()
+{
+    // the index is rebuilt from the pairs that stay
+    if (index)
+    {
+        jsfree(allocator, index, sizeof(slot) * index_capacity);
+        index = NULL;
+        index_capacity = 0;
+    }
+    size_t n = value_size;
+    value_size = 0;
+    if (n >= MAP_INDEX_MIN)
+    {
+        rehash(index_size_for(n));
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        const char *k = buff[i].key.asCString();
+        size_t len = buff[i].key.string_size();
+        const StringData *shared = interned_of(buff[i].key);
+        unsigned int h = !index ? 0 : shared ? shared->hash : hash_key(k, len);
+        if (index_of(k, len, h, shared) < value_size)
+        {
+            buff[i].~pair();
+            continue;
+        }
+        if (i != value_size)
+        {
+            memcpy((void*)&buff[value_size], &buff[i], sizeof(pair));
+        }
+        if (index)
+        {
+            index_insert(value_size, h);
+        }
+        value_size++;
+    }
 }
 
-internal::MapData::MapData() 
-    :ref(1)
-    ,value_size(0)
-    ,buff_capacity(MAP_INIT_SIZE)
+size_t internal::MapData::memory_usage() const
 {
-    buff = (pair*)jsmalloc(MAP_INIT_SIZE * sizeof(pair));
+    size_t s = sizeof(MapData) + sizeof(pair) * inline_capacity + sizeof(slot) * index_capacity;
+    if (buff != (const pair*)(this + 1))
+    {
+        s += sizeof(pair) * buff_capacity;
+    }
+    for (size_t i = 0; i < value_size; i++)
+    {
+        s += buff[i].key.memory_usage() + buff[i].value.memory_usage();
+    }
+    return s;
 }
 
 
@@ -1668,29 +5484,6 @@ static double powersOf10[] = {	/* Table giving binary powers of 10.  Entry */
     1.0e256
 };
 
-const Value & tjson::internal::MapData::find( const String &key ) const
-{
-    for (size_t i = 0; i < value_size; i++)
-    {
-        String &buff_key = buff[i].key;
-        if (key.size() == buff_key.size() && memcmp(key.c_str(), buff_key.c_str(), key.size()) == 0)
-        {
-            return buff[i].value;
-        }
-    }
-    return Value::Null;
-}
-
-tjson::internal::MapData::~MapData()
-{
-    for (size_t i = 0; i < value_size; i++)
-    {
-        buff[i].~pair();
-    }
-    jsfree(buff, buff_capacity * sizeof(pair));
-}
-
-
 /*
 *----------------------------------------------------------------------
 *
@@ -31,10 +31,105 @@
 #include <map>
 #include <malloc.h>
 #include <assert.h>
+
+// keys from string literals are hashed at compile time where the compiler
+// has constexpr, at run time before C++11 and VS2015
+#if __cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1900)
+#define TJSON_CONSTEXPR constexpr
+#else
+#define TJSON_CONSTEXPR
+#endif
+
+// moves from VS2010, noexcept on them (which std::vector needs to move
+// rather than copy when it grows) from VS2015
+#if __cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1600)
+#define TJSON_HAS_RVALUE_REFS 1
+#else
+#define TJSON_HAS_RVALUE_REFS 0
+#endif
+#if __cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1900)
+#define TJSON_NOEXCEPT noexcept
+#else
+#define TJSON_NOEXCEPT
+#endif
+
 namespace tjson
 {
     class Value;
-    size_t parse(const char *s, size_t len, Value *root);
+    class KeyTable;
+    class Handler;
+
+    // an object key with its length and hash worked out once, for fields
+    // read over and over:
+    //     static const tjson::Key kId("id");
+    //     v[kId].asInt();
+    // it points at the characters, which must outlive it
+    class Key
+    {
+    public:
+        template <size_t N>
+        TJSON_CONSTEXPR Key(const char (&s)[N])
+            :m_str(s)
+            ,m_len(length_of(s, N - 1))
+            ,m_hash(hash_of(s, length_of(s, N - 1), 2166136261u))
+        {
+        }
+        Key(const char *s, size_t len)
+            :m_str(s)
+            ,m_len(len)
+            ,m_hash(hash_of(s, len, 2166136261u))
+        {
+        }
+        TJSON_CONSTEXPR const char *c_str() const {return m_str;}
+        TJSON_CONSTEXPR size_t size() const {return m_len;}
+        TJSON_CONSTEXPR unsigned int hash() const {return m_hash;}
+    private:
+        static TJSON_CONSTEXPR size_t length_of(const char *s, size_t n)
+        {
+            return n && *s ? 1 + length_of(s + 1, n - 1) : 0;
+        }
+        // FNV-1a, the hash maps index their keys with
+        static TJSON_CONSTEXPR unsigned int hash_of(const char *s, size_t n, unsigned int h)
+        {
+            return n ? hash_of(s + 1, n - 1, (h ^ (unsigned char)*s) * 16777619u) : h;
+        }
+        const char *m_str;
+        size_t m_len;
+        unsigned int m_hash;
+    };
+
+    // where a tree gets its memory from, chosen per parse or per document.
+    // NULL everywhere means the built-in pool. Every value allocated from
+    // an allocator, copies sharing its containers included, must be gone
+    // before the allocator is
+    class Allocator
+    {
+    public:
+        virtual ~Allocator() {}
+        virtual void *allocate(size_t s) = 0;
+        virtual void deallocate(void *p, size_t s) = 0;
+    };
+
+    // what parsing does with a key repeated within one object
+    enum DuplicateKeys
+    {
+        JD_LAST_WINS,   // keeps the first position with the last value
+        JD_FIRST_WINS,  // later values are dropped
+        JD_ERROR,       // the parse fails at the repeated key
+        JD_KEEP_ALL,    // no check, every pair is kept and lookups find the first
+    };
+
+    size_t parse(const char *s, size_t len, Value *root, Allocator *alloc = NULL, DuplicateKeys dup = JD_LAST_WINS);
+    // streams the document to handler, no tree is built
+    size_t parse(const char *s, size_t len, Handler *handler);
+    // parse in place: strings are unescaped inside buf and the tree borrows
+    // them, so buf must outlive root and its content is destroyed
+    size_t parse_insitu(char *buf, size_t len, Value *root, Allocator *alloc = NULL, DuplicateKeys dup = JD_LAST_WINS);
+    // free pool memory beyond this many bytes is given back to the system
+    // as whole pages come free, the default is POOL_RETENTION
+    void set_memory_retention(size_t bytes);
+    // gives every unused pool page back to the system, returns bytes freed
+    size_t trim_memory();
 
     enum Type
     {
@@ -52,38 +147,69 @@ namespace tjson
         struct MapData;
         struct StringData;
         struct VectorData;
-        class Map;
-        class String;
-        class Vector;
+        struct write_state;
 
         void *jsmalloc(size_t s);
         void jsfree(void *p, size_t s);
 
-        template <class T>
-        class jmem_obj
+        // monotonic allocator: carves blocks out of a few large chunks and
+        // gives all of them back at once, freeing a single block is a no-op.
+        // Chunks come from upstream, or malloc when it is NULL
+        class Arena : public Allocator
         {
         public:
-            virtual ~jmem_obj(){};
-            void *operator new(size_t s)
+            Arena(Allocator *upstream = NULL):m_head(NULL),m_upstream(upstream){}
+            ~Arena();
+            void *allocate(size_t s) {return alloc(s);}
+            void deallocate(void *, size_t) {}
+            void *alloc(size_t s)
             {
-                return jsmalloc(s);
+                s = (s + 7) & ~(size_t)7;
+                if (m_head && m_head->size - m_head->used >= s)
+                {
+                    void *p = (char*)(m_head + 1) + m_head->used;
+                    m_head->used += s;
+                    return p;
+                }
+                return alloc_chunk(s);
             }
-            void *operator new[](size_t s)
+            // releases every block but keeps the largest chunk for reuse
+            void clear();
+            size_t used() const;     // bytes handed out
+            size_t reserved() const; // bytes held in chunks
+        private:
+            Arena(const Arena &);
+            Arena &operator=(const Arena &);
+            struct chunk
             {
-                char *p = (char*)jsmalloc(s + sizeof(size_t));
-                *(size_t*)p = s/sizeof(T);
-                return p + sizeof(size_t);
-            }
-            void operator delete(void *p)
+                chunk *next;
+                size_t size;
+                size_t used;
+            };
+            void *alloc_chunk(size_t s);
+            chunk *new_chunk(size_t size);
+            void free_chunk(chunk *c);
+            chunk *m_head;
+            Allocator *m_upstream;
+        };
+
+        // a NULL allocator means the shared pool
+        inline void *jsmalloc(Allocator *a, size_t s)
+        {
+            return a ? a->allocate(s) : jsmalloc(s);
+        }
+
+        inline void jsfree(Allocator *a, void *p, size_t s)
+        {
+            if (a)
             {
-                jsfree(p, sizeof(T));
+                a->deallocate(p, s);
             }
-            void operator delete[](void *p)
+            else
             {
-                size_t c = *(size_t*)((char*)p-sizeof(size_t));
-                jsfree((char*)p-sizeof(size_t), c*sizeof(T));
+                jsfree(p, s);
             }
-        };
+        }
 
         template<typename _Tp>
         class jmem_alloc
@@ -158,6 +284,7 @@ namespace tjson
             }
         };
 
+        // drops a reference to a shared block, the last one frees it
         template <class T>
         inline void delete_data(T *pData)
         {
@@ -166,445 +293,713 @@ namespace tjson
                 pData->ref--;
                 if (pData->ref <= 0)
                 {
-                    delete pData;
-                    pData = NULL;
+                    T::destroy(pData);
                 }
             }
         }
 
-        template <class T>
-        inline size_t data_size(const T *pData)
-        {
-            if (pData)
-            {
-                return pData->size();
-            }
-            return 0;
-        }
-
-        template <class T>
-        inline void data_copy(T &l, const T &r)
+        // a string too long to sit inside a Value, its characters follow
+        // the header unless they are borrowed. An interned one belongs to
+        // its KeyTable, every key equal to it shares it and it is never
+        // destroyed through a value
+        struct StringData
         {
-            l.m_data = r.m_data;
-            if (l.m_data)
-            {
-                l.m_data->ref++;
-            }
-        }
-
-        template <class T>
-        inline T& data_set(T &l, const T &r)
-        {
-            if (l.m_data != r.m_data)
-            {
-                delete_data(l.m_data);
-                data_copy(l, r);
-            }
-            return l;
-        }
-
-        struct StringData : public jmem_obj<StringData>
-        {
-            StringData();
-            ~StringData();
+            // copies exactly len bytes, or borrows s when borrow is set
+            static StringData *create(const char *s, size_t len, bool borrow, Allocator *a);
+            static void destroy(StringData *d);
             size_t size() const {return value_size;}
-            StringData &operator=(const char *s);
-            void assign(const char *s, size_t len);
-            int ref;
+            size_t memory_usage() const;
             char *buff;
-        private:            
+            Allocator *allocator;  // for an interned string, its table's arena
             size_t value_size;
-            size_t buff_capacity;            
-        };    
-
-        class String : public jmem_obj<String>
-        {
-        public:
-            String():m_data(NULL){}
-
-            String(const char *s, size_t c)
-            {
-                m_data = new StringData;
-                m_data->assign(s, c);
-            }
-            String(const String &s)
-            {
-                data_copy(*this, s);
-            }
-            ~String()
-            {
-                delete_data(m_data);
-            }
-            bool operator == (const String &s) const;
-            String &operator=(const String &s)
-            {
-                return data_set(*this, s);
-            }
-            size_t size() const
-            {
-                return data_size(m_data);
-            }        
-
-            bool operator<(const String &r) const;
-
-            const char *c_str() const
-            {
-                if (m_data)
-                {
-                    return m_data->buff;
-                }
-                return NULL;
-            }
-            template <class T>
-            friend void data_copy(T &l, const T &r);
-            template <class T>
-            friend T& data_set(T &l, const T &r);
-            StringData *m_data;
+            unsigned int hash;     // only set when interned
+            bool borrowed;
+            bool interned;
         };
 
-        struct VectorData : public jmem_obj<VectorData>
-        {            
-            VectorData();
-            ~VectorData();
-            void increase_size();
-            size_t size() const {return value_size;}  
+        // an array, shared by every copy of its value. The elements follow
+        // the header in the same block until the array outgrows them
+        struct VectorData
+        {
+            static VectorData *create(Allocator *a, size_t capacity);
+            static void destroy(VectorData *d);
+            size_t size() const {return value_size;}
+            size_t memory_usage() const;
+            Value *push_back();
+            void reserve(size_t n);
+            bool erase(size_t pos);
             int ref;
+            Allocator *allocator;
             Value *buff;
-        private:            
             size_t value_size;
-            size_t buff_capacity;            
-        };
-
-        class Vector : public jmem_obj<Vector>
-        {
-        public:
-            Vector():m_data(NULL){}
-            Vector(const Vector &vec)
-            {
-                data_copy(*this, vec);
-            }
-            ~Vector()
-            {
-                delete_data(m_data);
-            }
-            Vector &operator=(const Vector &s)
-            {
-                return data_set(*this, s);
-            }
-            Value *back();
-            Value *push_back();
-            size_t size() const
-            {
-                return data_size(m_data);
-            } 
-            Value &operator[](size_t idx);
-            VectorData *m_data;
-            template <class T>
-            friend void data_copy(T &l, const T &r);
-            template <class T>
-            friend T& data_set(T &l, const T &r);
+            size_t buff_capacity;
+            size_t inline_capacity; // elements in the header's own block
+        private:
+            void grow();
         };
-          
     }// namespace internal
 
     class Value : public internal::jmem_alloc<Value>
     {
     public:
         Value()
-            :internal::jmem_alloc<Value>(),m_type(JT_NULL),m_intval(0),internal_parent(NULL)
         {
-
+            make_null();
         }
 
         Value(const Value &v)
-            :internal::jmem_alloc<Value>(),m_type(JT_NULL),m_intval(0),internal_parent(NULL)
+            :internal::jmem_alloc<Value>()
         {
             assign(v);
         }
 
+#if TJSON_HAS_RVALUE_REFS
+        // takes whatever v holds, v is left null
+        Value(Value &&v) TJSON_NOEXCEPT
+            :internal::jmem_alloc<Value>()
+        {
+            Allocator *a = v.hint();
+            memcpy(m_short, v.m_short, sizeof(m_short));
+            set_hint(NULL);
+            v.make_null();
+            v.set_hint(a);
+        }
+        // not noexcept: v is copied into the allocator of the value it
+        // replaces when it does not come from there
+        Value &operator = (Value &&v);
+#endif
+
         Value(long long v)
-            :internal::jmem_alloc<Value>(),m_type(JT_INTEGER),m_intval(v),internal_parent(NULL)
         {
+            make_null();
+            m_intval = v;
+            set_tag(JT_INTEGER);
         }
 
         Value(int v)
-            :internal::jmem_alloc<Value>(),m_type(JT_INTEGER),m_intval(v),internal_parent(NULL)
         {
+            make_null();
+            m_intval = v;
+            set_tag(JT_INTEGER);
         }
 
         Value(double v)
-            :internal::jmem_alloc<Value>(),m_type(JT_DOUBLE),m_fval(v),internal_parent(NULL)
         {
+            make_null();
+            m_fval = v;
+            set_tag(JT_DOUBLE);
         }
 
         Value( const char *v ) 
-            :internal::jmem_alloc<Value>(),m_type(JT_STRING),m_intval(0),internal_parent(NULL)
         {
-            m_strval = new internal::String(v, strlen(v));
+            make_null();
+            internal_build_string(v, strlen(v));
         }
 
         Value(bool v)
-            :internal::jmem_alloc<Value>(),m_type(JT_BOOL),m_bool(v),internal_parent(NULL)
         {
+            make_null();
+            m_bool = v;
+            set_tag(JT_BOOL);
         }
 
         ~Value() {destroy();}  
 
         Value &operator = (const Value &v);        
+        // exchanges the contents, nothing is copied or allocated. What a
+        // null remembers of its container stays where it is
+        void swap(Value &v) TJSON_NOEXCEPT
+        {
+            Allocator *a = hint();
+            Allocator *b = v.hint();
+            char tmp[sizeof(m_short)];
+            memcpy(tmp, m_short, sizeof(m_short));
+            memcpy(m_short, v.m_short, sizeof(m_short));
+            memcpy(v.m_short, tmp, sizeof(m_short));
+            set_hint(a);
+            v.set_hint(b);
+        }
 
         Value &operator[](size_t index)
         {
-            if (m_type == JT_ARRAY)
+            if (tag() == JT_ARRAY)
             {
                 assert(m_array);
-                return (*m_array)[index];
+                return m_array->buff[index].slot_in(m_array->allocator);
             }
             return Null;
         }
         const Value &operator[](size_t index) const
         {
-            if (m_type == JT_ARRAY)
+            if (tag() == JT_ARRAY)
             {
                 assert(m_array);
-                return (*m_array)[index];
+                return m_array->buff[index];
             }
             return Null;
         }
         const Value &operator[](const char *k) const;
         Value &operator[](const char *k);
+        const Value &operator[](const Key &k) const;
+        Value &operator[](const Key &k);
+        // the value under k, NULL when this is not an object or k is missing
+        const Value *find(const char *k) const;
+        const Value *find(const Key &k) const;
+        // a copy of the value under k, default_value when k is missing
         template <class T>
         Value get(const char *k, const T &default_value) const;
+        // typed reads that copy nothing, k is a const char * or a Key. def
+        // comes back when k is missing or holds another type, integers and
+        // doubles convert to each other
+        template <class K> long long getInt(const K &k, long long def = 0) const;
+        template <class K> double getDouble(const K &k, double def = 0) const;
+        template <class K> bool getBool(const K &k, bool def = false) const;
+        // points into the tree, *len is set when len is not NULL
+        template <class K> const char *getString(const K &k, const char *def = NULL, size_t *len = NULL) const;
+        // false, *out left alone, when k is missing or holds another type
+        template <class K> bool tryGet(const K &k, long long *out) const;
+        template <class K> bool tryGet(const K &k, double *out) const;
+        template <class K> bool tryGet(const K &k, bool *out) const;
+        template <class K> bool tryGet(const K &k, const char **out, size_t *len = NULL) const;
 
-        bool isBool() const    { return m_type == JT_BOOL;    }
-        bool isNumeric() const   { return m_type == JT_DOUBLE || m_type == JT_INTEGER;   }
-        bool isDouble() const   { return m_type == JT_DOUBLE;   }
-        bool isInt() const { return m_type == JT_INTEGER; }
-        bool isString() const  { return m_type == JT_STRING;  }
-        bool isArray() const   { return m_type == JT_ARRAY;   }
-        bool isObject() const  { return m_type == JT_OBJECT;  }
-        bool isNull() const    { return m_type == JT_NULL;    }
-        Type GetType() const   { return m_type;               }
-        bool asBool() const         { return m_bool;   }
+        bool isBool() const    { return tag() == JT_BOOL;    }
+        bool isNumeric() const   { return tag() == JT_DOUBLE || tag() == JT_INTEGER;   }
+        bool isDouble() const   { return tag() == JT_DOUBLE;   }
+        bool isInt() const { return tag() == JT_INTEGER; }
+        bool isString() const  { return GetType() == JT_STRING;  }
+        bool isArray() const   { return tag() == JT_ARRAY;   }
+        bool isObject() const  { return tag() == JT_OBJECT;  }
+        bool isNull() const    { return tag() == JT_NULL;    }
+        Type GetType() const   { return (Type)(tag() & ~INLINE); }
+        bool asBool() const         { return tag() != JT_NULL && m_bool;   }
         double asDouble() const      
         {
-            if (m_type == JT_INTEGER)
+            if (tag() == JT_INTEGER)
                 return (double)m_intval; 
-            if (m_type == JT_DOUBLE)
+            if (tag() == JT_DOUBLE)
                 return m_fval;
-            if (m_type == JT_BOOL)
+            if (tag() == JT_BOOL)
                 return m_bool?1:0;
-            if (m_type == JT_NULL)
+            if (tag() == JT_NULL)
                 return 0;
             return 0;  
         }
         long long asInt() const 
         {
-            if (m_type == JT_INTEGER)
+            if (tag() == JT_INTEGER)
                 return m_intval; 
-            if (m_type == JT_DOUBLE)
+            if (tag() == JT_DOUBLE)
                 return (long long)m_fval;
-            if (m_type == JT_BOOL)
+            if (tag() == JT_BOOL)
                 return m_bool?1:0;
-            if (m_type == JT_NULL)
+            if (tag() == JT_NULL)
                 return 0;
             return 0;            
         }
         unsigned long long asUInt() const 
         {
-            if (m_type == JT_INTEGER)
+            if (tag() == JT_INTEGER)
                 return (unsigned long long)m_intval; 
-            if (m_type == JT_DOUBLE)
+            if (tag() == JT_DOUBLE)
                 return (unsigned long long)m_fval;
-            if (m_type == JT_BOOL)
+            if (tag() == JT_BOOL)
                 return m_bool?1:0;
-            if (m_type == JT_NULL)
+            if (tag() == JT_NULL)
                 return 0;
             return 0;            
         }
         const char* asCString() const 
         { 
-            if (m_type == JT_STRING)
+            if (tag() == SHORT_STRING)
+            {
+                return m_short;
+            }
+            if (tag() == JT_STRING)
             {
                 assert(m_strval);
-                return m_strval->c_str(); 
+                return m_strval->buff; 
             }
             return NULL;
         }
         static Value Null;
         
         size_t size() const;
+        // bytes allocated for this value and everything below it
+        size_t memory_usage() const;
         template <class VECT>
         void GetKeys(VECT *vec) const;
+
+        // building and changing trees. Copies of a value share its arrays
+        // and objects, so changes made through one show in all of them.
+        // Containers grow geometrically, reserve sizes them up front.
+        // Values in an arena, like those of a Document, keep to it: a value
+        // assigned, appended or set there is copied into the arena unless
+        // it already lives in it, and containers made in place of any
+        // value of the tree, scalars included, are allocated from it
+
+        // drops what this held for an empty array or object with room for
+        // capacity children
+        void makeArray(size_t capacity = 0);
+        void makeObject(size_t capacity = 0);
+        // room for n children of an array or object
+        void reserve(size_t n);
+        // adds v at the end of an array, a null becomes an array first.
+        // Returns the stored value, NULL when this holds anything else
+        Value *append(const Value &v);
+        // sets member k of an object, replacing the value of an existing
+        // key, a null becomes an object first. Returns the stored value,
+        // NULL when this holds anything else
+        Value *set(const char *k, const Value &v);
+        Value *set(const Key &k, const Value &v);
+#if TJSON_HAS_RVALUE_REFS
+        Value *append(Value &&v);
+        Value *set(const char *k, Value &&v);
+        Value *set(const Key &k, Value &&v);
+#endif
+        // removes an element of an array or a member of an object, false
+        // when there is no such child
+        bool erase(size_t index);
+        bool erase(const char *k);
+        bool erase(const Key &k);
     private:
+        friend struct internal::MapData;
+        friend struct internal::write_state;
+        friend class Document;
+        enum
+        {
+            SHORT_MAX = 14,                  // longest string kept inline
+            SMALL_MAX = 7,                   // the same in a tree with an allocator
+            SMALL = 0x7f,                    // in m_short[SHORT_MAX] of those
+            HINT_AT = 8,                     // where scalars and small strings
+            HINT_SIZE = 6,                   // keep their allocator
+            INLINE = 0x80,                   // tag bit of inline payloads
+            SHORT_STRING = INLINE | JT_STRING
+        };
+        // the type sits in the last byte whatever the payload is
+        unsigned char tag() const {return (unsigned char)m_short[15];}
+        void set_tag(unsigned char t) {m_short[15] = (char)t;}
+        size_t string_size() const
+        {
+            if (tag() == SHORT_STRING)
+            {
+                return m_short[SHORT_MAX] == SMALL ? SMALL_MAX - m_short[SMALL_MAX] : SHORT_MAX - m_short[SHORT_MAX];
+            }
+            return m_strval->size();
+        }
+        // a null with nothing in its spare bytes
+        void make_null()
+        {
+            memset(m_short, 0, sizeof(m_short));
+        }
         void destroy();
         void assign( const Value &v );
-        Type m_type;
+        // where this value's memory comes from, or for a null, a scalar
+        // or a small string in a container, the container's. NULL for the
+        // pool
+        Allocator *allocator() const;
+        // copies every string and container of this value that does not
+        // come from a into it, nothing for NULL
+        void adopt(Allocator *a);
+        // the allocator of the container a value that owns no memory
+        // sits in, NULL for anything else. A null keeps it in its payload,
+        // scalars and small strings its address over 4 in the HINT_SIZE
+        // bytes at HINT_AT, which holds any allocator below 2^50
+        bool has_spare() const
+        {
+            return (tag() >= JT_BOOL && tag() <= JT_INTEGER)
+                || (tag() == SHORT_STRING && m_short[SHORT_MAX] == SMALL);
+        }
+        static bool fits_hint(Allocator *a)
+        {
+            return ((size_t)a & 3) == 0 && ((unsigned long long)(size_t)a >> (8 * HINT_SIZE + 2)) == 0;
+        }
+        Allocator *hint() const
+        {
+            if (tag() == JT_NULL)
+            {
+                return m_alloc;
+            }
+            unsigned long long p = 0;
+            if (has_spare())
+            {
+                for (int i = HINT_SIZE; i-- > 0;)
+                {
+                    p = p << 8 | (unsigned char)m_short[HINT_AT + i];
+                }
+            }
+            return (Allocator *)(size_t)(p << 2);
+        }
+        // an allocator that does not fit is dropped, the value then
+        // builds from the pool
+        void set_hint(Allocator *a)
+        {
+            if (tag() == JT_NULL)
+            {
+                m_alloc = a;
+            }
+            else if (has_spare())
+            {
+                unsigned long long p = fits_hint(a) ? (unsigned long long)(size_t)a >> 2 : 0;
+                for (int i = 0; i < HINT_SIZE; i++)
+                {
+                    m_short[HINT_AT + i] = (char)(p >> 8 * i);
+                }
+            }
+        }
+        Value &slot_in(Allocator *a)
+        {
+            if (a && hint() != a)
+            {
+                set_hint(a);
+            }
+            return *this;
+        }
+        // a null becomes an empty container of type t, false when this
+        // holds anything else
+        bool become(Type t);
+        // append and set with v already out of the way, v is left with
+        // the replaced value
+        Value *append_taken(Value &v);
+        Value *set_taken(const char *k, size_t len, const Key *key, Value &v);
+        // 16 bytes: an 8 byte payload, or an inline string of up to
+        // SHORT_MAX characters whose unused length is kept in the byte
+        // after them, so a full one ends in 0 as well. In a tree with an
+        // allocator a string stays inline up to SMALL_MAX characters, which
+        // leaves room for the allocator as a scalar has. A child of a
+        // container that owns no memory holds the container's allocator,
+        // copies drop it
         union {
-            internal::Vector *m_array;
-            internal::Map    *m_dict;
-            internal::String *m_strval;
+            Allocator *m_alloc;
+            internal::VectorData *m_array;
+            internal::MapData    *m_dict;
+            internal::StringData *m_strval;
             long long m_intval;
             double m_fval;
             bool  m_bool;
+            char  m_short[16];
         };       
 
     public:
-        void internal_build_string(const char *s, size_t l);
-        void internal_build_object();
-        void internal_build_array();
+        void internal_build_string(const char *s, size_t l, bool borrow = false, Allocator *a = NULL);
+        // an empty container only allocates when it has an allocator to remember
+        void internal_build_object(Allocator *a = NULL);
+        void internal_build_array(Allocator *a = NULL);
         void internal_build_bool(bool v);
         void internal_build_float(const char *s);
         void internal_build_integer(const char *s);
-        Value *internal_add_key(const char *k, size_t l);
+        // further children come from the allocator the container was built
+        // with. NULL for a key repeated under JD_ERROR, JD_FIRST_WINS adds
+        // repeats until internal_end_object drops them
+        Value *internal_add_key(const char *k, size_t l, bool borrow = false, DuplicateKeys dup = JD_LAST_WINS, KeyTable *keys = NULL);
+        // a key string, shared through keys when it is too long to be inline
+        void internal_build_key(const char *k, size_t l, bool borrow, Allocator *a, KeyTable *keys);
         Value *internal_add();
-        Value *internal_parent;
+        void internal_end_object(DuplicateKeys dup);
+        // hand a container its children, moved out of the parse stack, see
+        // MapData::take for the result
+        void internal_take_array(Value *items, size_t n, Allocator *a);
+        size_t internal_take_object(Value *keys, Value *values, size_t n, Allocator *a, DuplicateKeys dup);
     };
 
     namespace internal
     {
-        struct MapData : public jmem_obj<MapData>
+        // an object, shared by every copy of its value. Keys are string
+        // values, the pairs follow the header like array elements do
+        struct MapData
         {         
             struct pair
             {
-                String key;
+                Value key;
                 Value value;
             };
-            MapData();
-            ~MapData();
+            static MapData *create(Allocator *a, size_t capacity);
+            static void destroy(MapData *d);
             size_t size() const {return value_size;}            
-            Value &operator[](const String &key);
+            size_t memory_usage() const;
+            // the value under k, added as null when it is missing. Added keys
+            // are interned in keys when it is set
+            Value &get(const char *k, size_t len, bool borrow = false, KeyTable *keys = NULL);
+            const Value &find(const char *k, size_t len) const;
+            const Value &find(const Key &k) const;
+            Value &get(const Key &k);
+            // adds k without looking for it first
+            Value &append(const char *k, size_t len, bool borrow = false, KeyTable *keys = NULL);
+            // takes over n keys and values relocated from the two arrays and
+            // settles repeated keys by dup. Under JD_ERROR it stops at the
+            // first repeat and returns its position, n otherwise
+            size_t take(Value *keys, Value *values, size_t n, DuplicateKeys dup);
+            // drops every pair whose key was seen before it
+            void drop_repeats();
+            void reserve(size_t n);
+            // removes the first pair with key k, false without one
+            bool erase(const char *k, size_t len);
+            bool erase(const Key &k);
             
             template <class VECT>
             void GetKeys(VECT *vec) const
             {
                 for (size_t i = 0; i < value_size; i++)
                 {
-                    vec->push_back(buff[i].key.c_str());
+                    vec->push_back(buff[i].key.asCString());
                 }
             }
 
-            const Value &find(const String &key) const;
-
             int ref;
-                        
-        private:
+            Allocator *allocator;
             pair *buff;
             size_t value_size;  
             size_t buff_capacity;                        
+            size_t inline_capacity;
+        private:
+            // open addressing hash index, kept once a map reaches
+            // MAP_INDEX_MIN keys so lookups stop scanning every key
+            struct slot
+            {
+                unsigned int pos;  // pair index + 1, 0 when the slot is free
+                unsigned int hash;
+            };
+            static bool same_key(const Value &key, const char *k, size_t len, const StringData *shared);
+            static StringData *interned_of(const Value &key);
+            size_t index_of(const char *k, size_t len, unsigned int h, const StringData *shared = NULL) const;
+            Value &add(const char *k, size_t len, bool borrow, unsigned int h, StringData *shared);
+            void index_insert(size_t pos, unsigned int h);
+            void rehash(size_t capacity);
+            void grow();
+            bool remove(size_t pos);
+            void unindex(size_t pos);
+            slot *index;
+            size_t index_capacity; // a power of two, or 0 without an index
         };
 
-        class Map : public jmem_obj<Map>
-        {
-        public:
-            Map():m_data(NULL){};
-            Map(const Map &m)
-            {
-                data_copy(*this, m);
-            }
-            ~Map()
-            {
-                delete_data(m_data);
-            }
-            Map &operator=(const Map &s)
-            {
-                return data_set(*this, s);
-            }
-            size_t size() const
-            {
-                return data_size(m_data);
-            } 
-            Value &operator[](const String &k)
-            {
-                if (!m_data)
-                {
-                    m_data = new MapData;
-                }
-                return (*m_data)[k];
-            }
+        struct scan_state;
+    }
 
-            const Value &operator[](const String &k) const
-            {
-                return find(k);                
-            }
+    // interns object keys: equal keys parsed with the same table share one
+    // immutable, pre-hashed string and compare by address. Keys short enough
+    // to sit inside a value never need it. Trees keep pointing into the
+    // table, so it must outlive every value parsed with it, and it serves
+    // one parse at a time
+    class KeyTable
+    {
+    public:
+        KeyTable(Allocator *upstream = NULL);
+        ~KeyTable();
+        size_t size() const {return m_size;} // distinct keys
+        // bytes held by the table, its keys are not counted by the values
+        // using them
+        size_t memory_usage() const;
+        // forgets every key, only once no value uses them any more
+        void clear();
+        internal::StringData *internal_find_or_add(const char *k, size_t len);
+    private:
+        KeyTable(const KeyTable &);
+        KeyTable &operator=(const KeyTable &);
+        void grow();
+        internal::Arena m_arena;          // the strings
+        internal::StringData **m_slots;   // open addressing, a power of two
+        size_t m_capacity;
+        size_t m_size;
+    };
 
-            template <class VECT>
-            void GetKeys(VECT *vec) const
-            {
-                if (m_data)
-                {
-                    m_data->GetKeys(vec);
-                }
-            }
+    class Document;
 
-            const Value &find(const String &k) const
-            {
-                if (m_data)
-                {
-                    return m_data->find(k);
-                }
-                return Value::Null;
-            }
-      
-            MapData *m_data;
-            template <class T>
-            friend inline void data_copy(T &l, const T &r);
-            template <class T>
-            friend T& data_set(T &l, const T &r);
-        };      
-    }
-    
-    inline Value *internal::Vector::push_back()
+    // receives a document as it is read, in order. Strings point into the
+    // source or a scratch buffer, are not 0 terminated and only live for
+    // the call. Keys come as they are, repeats included, and the End
+    // events get the number of members or elements. Returning false stops
+    // the parse, which then fails where it stopped. Every event is
+    // accepted and ignored unless overridden
+    class Handler
     {
-        if (!m_data)
-        {
-            m_data = new VectorData;                    
-        }
-        m_data->increase_size();
-        return &m_data->buff[m_data->size() - 1];
-    }
+    public:
+        virtual ~Handler() {}
+        virtual bool Null() {return true;}
+        virtual bool Bool(bool) {return true;}
+        virtual bool Int(long long) {return true;}
+        virtual bool Double(double) {return true;}
+        virtual bool String(const char *, size_t) {return true;}
+        virtual bool StartObject() {return true;}
+        virtual bool Key(const char *, size_t) {return true;}
+        virtual bool EndObject(size_t) {return true;}
+        virtual bool StartArray() {return true;}
+        virtual bool EndArray(size_t) {return true;}
+    };
 
-    inline Value *internal::Vector::back()
+    // keeps its nesting stack, scratch and index buffers from one document
+    // to the next, the cheaper way to parse many documents in a row
+    class Parser
     {
-        size_t iSize = size();
-        if (iSize > 0)
-        {
-            return &m_data->buff[iSize-1];
-        }
-        return NULL;
-    }
+    public:
+        Parser();
+        ~Parser();
+        size_t parse(const char *s, size_t len, Value *root, Allocator *alloc = NULL);
+        size_t parse_insitu(char *buf, size_t len, Value *root, Allocator *alloc = NULL);
+        // parse into doc, dropping whatever it held before
+        size_t parse(const char *s, size_t len, Document *doc);
+        size_t parse(const char *s, size_t len, Handler *handler);
+        size_t parse_insitu(char *buf, size_t len, Document *doc);
+        // push parsing, for a document that arrives in pieces: start says
+        // where it goes, feed takes the pieces in order, split anywhere,
+        // and finish ends it. Each returns 0 or the error position counted
+        // over everything fed, and after an error the rest return the same.
+        // Only a token split between pieces is copied, so pieces need not
+        // outlive the call
+        void start(Value *root, Allocator *alloc = NULL);
+        void start(Document *doc);
+        void start(Handler *handler);
+        size_t feed(const char *s, size_t len);
+        size_t finish();
+        // applies to every parse that follows, JD_LAST_WINS by default
+        void set_duplicate_keys(DuplicateKeys dup);
+        // long keys of the parses that follow are interned in keys, NULL
+        // (the default) gives every key its own copy
+        void set_key_table(KeyTable *keys);
+        void reset();
+    private:
+        Parser(const Parser &);
+        Parser &operator=(const Parser &);
+        internal::scan_state *m_state;
+    };
 
-    inline Value &internal::Vector::operator[](size_t idx)
+    // a parsed tree together with the arena all of its nodes come from, the
+    // whole tree is released at once without being visited. Values copied
+    // out of root() share its memory and must not outlive the document.
+    // Whatever is built or stored into the tree later is copied into the
+    // arena as well, see Value. The arena takes its chunks from upstream, or
+    // malloc when it is NULL
+    class Document
     {
-        return m_data->buff[idx];
-    }
+    public:
+        Document(Allocator *upstream = NULL);
+        ~Document() {}
+        size_t parse(const char *s, size_t len, DuplicateKeys dup = JD_LAST_WINS);
+        size_t parse_insitu(char *buf, size_t len, DuplicateKeys dup = JD_LAST_WINS);
+        Value &root() {return m_root->slot_in(&m_arena);}
+        const Value &root() const {return *m_root;}
+        // drops the tree, the arena keeps its largest chunk
+        void clear();
+        size_t memory_used() const {return m_arena.used();}
+        size_t memory_reserved() const {return m_arena.reserved();}
+    private:
+        Document(const Document &);
+        Document &operator=(const Document &);
+        friend class Parser;
+        internal::Arena m_arena;
+        Value *m_root;
+    };
+
+    // what a LineReader calls back with, line counts from 1
+    class LineHandler
+    {
+    public:
+        virtual ~LineHandler() {}
+        // root lives until the next record, false stops reading
+        virtual bool record(size_t line, Value &root) = 0;
+        // the record failed at pos within its line, true skips it and
+        // reads on
+        virtual bool error(size_t, size_t) {return false;}
+    };
+
+    // newline delimited documents (JSON Lines), read one at a time with
+    // one parser into one document, so a record costs little more than its
+    // parse. Lines may end in \r\n, blank ones are skipped. The buffer is
+    // read where it is and must outlive the reading
+    class LineReader
+    {
+    public:
+        LineReader(Allocator *upstream = NULL);
+        void set_duplicate_keys(DuplicateKeys dup);
+        void set_key_table(KeyTable *keys);
+        void start(const char *s, size_t len);
+        // reads the next record, false when none is left. error() is then
+        // 0 and root() the record, or where in the line it failed
+        bool next();
+        size_t error() const {return m_error;}
+        size_t line() const {return m_line;}
+        Value &root() {return m_doc.root();}
+        // reads every record of s, returns how many went to the handler
+        size_t read(const char *s, size_t len, LineHandler *handler);
+    private:
+        LineReader(const LineReader &);
+        LineReader &operator=(const LineReader &);
+        Parser m_parser;
+        Document m_doc;
+        const char *m_pos;
+        const char *m_end;
+        size_t m_line;
+        size_t m_error;
+    };
+
+    // where a Writer streams its output, a piece at a time
+    class Sink
+    {
+    public:
+        virtual ~Sink() {}
+        virtual void write(const char *s, size_t len) = 0;
+    };
 
-    inline internal::StringData::~StringData()
+    // serializes trees, compact unless told otherwise. The output buffer is
+    // kept from one call to the next, so a writer reused for many documents
+    // stops allocating. Doubles are written in digits that read back as the
+    // same double, nearly always the fewest that do, NaN and infinities as
+    // null
+    class Writer
     {
-        assert(ref == 0);
-        jsfree(buff, buff_capacity);
+    public:
+        Writer();
+        ~Writer();
+        // pretty printing: one child per line, indented by n c's a level.
+        // 0 (the default) writes compact
+        void set_indent(unsigned n, char c = ' ');
+        // canonical output, the same bytes for equal trees: no whitespace,
+        // keys sorted by their UTF-8 bytes (repeated keys stay in order),
+        // whole doubles below 2^53 written like the integers they equal
+        // (larger ones in exponent form), and -0 as 0.
+        // Overrides the indent
+        void set_canonical(bool canonical);
+        // the text of v, 0 terminated and valid until the next write. *len
+        // is set when len is not NULL
+        const char *write(const Value &v, size_t *len = NULL);
+        // hands the text of v to sink, buffering one piece of it at a time
+        void write(const Value &v, Sink *sink);
+    private:
+        Writer(const Writer &);
+        Writer &operator=(const Writer &);
+        internal::write_state *m_state;
+    };
+    
+    inline Value *internal::VectorData::push_back()
+    {
+        if (value_size == buff_capacity)
+        {
+            grow();
+        }
+        return ::new(&buff[value_size++]) Value;
     }
 
     inline size_t Value::size() const
     {
-        if (m_type == JT_ARRAY)
+        if (tag() == JT_ARRAY)
         {
-            assert(m_array);
-            return m_array->size();
+            return m_array ? m_array->size() : 0;
         }
-        else if (m_type == JT_OBJECT)
+        else if (tag() == JT_OBJECT)
         {
-            assert(m_dict);
-            return m_dict->size();
+            return m_dict ? m_dict->size() : 0;
         }
         return 0;
     }
 
+    inline void swap(Value &a, Value &b) TJSON_NOEXCEPT
+    {
+        a.swap(b);
+    }
+
     template <class VECT>
     void Value::GetKeys(VECT *vec) const
     {
-        if (m_type == JT_OBJECT)
+        if (tag() == JT_OBJECT && m_dict)
         {
-            assert(m_dict);
             m_dict->GetKeys(vec);
         }
     }
@@ -612,12 +1007,95 @@ namespace tjson
     template <class T>
     Value Value::get( const char *k, const T &default_value ) const
     {
-        if (m_type == JT_OBJECT)
+        const Value *v = find(k);
+        if (v)
         {
-            assert(m_dict);
-            return m_dict->find(internal::String(k,strlen(k)));
+            return *v;
         }
         return default_value;
     }
 
+    template <class K>
+    bool Value::tryGet( const K &k, long long *out ) const
+    {
+        const Value *v = find(k);
+        if (!v || !v->isNumeric())
+        {
+            return false;
+        }
+        *out = v->asInt();
+        return true;
+    }
+
+    template <class K>
+    bool Value::tryGet( const K &k, double *out ) const
+    {
+        const Value *v = find(k);
+        if (!v || !v->isNumeric())
+        {
+            return false;
+        }
+        *out = v->asDouble();
+        return true;
+    }
+
+    template <class K>
+    bool Value::tryGet( const K &k, bool *out ) const
+    {
+        const Value *v = find(k);
+        if (!v || !v->isBool())
+        {
+            return false;
+        }
+        *out = v->asBool();
+        return true;
+    }
+
+    template <class K>
+    bool Value::tryGet( const K &k, const char **out, size_t *len ) const
+    {
+        const Value *v = find(k);
+        if (!v || !v->isString())
+        {
+            return false;
+        }
+        *out = v->asCString();
+        if (len)
+        {
+            *len = v->string_size();
+        }
+        return true;
+    }
+
+    template <class K>
+    long long Value::getInt( const K &k, long long def ) const
+    {
+        tryGet(k, &def);
+        return def;
+    }
+
+    template <class K>
+    double Value::getDouble( const K &k, double def ) const
+    {
+        tryGet(k, &def);
+        return def;
+    }
+
+    template <class K>
+    bool Value::getBool( const K &k, bool def ) const
+    {
+        tryGet(k, &def);
+        return def;
+    }
+
+    template <class K>
+    const char *Value::getString( const K &k, const char *def, size_t *len ) const
+    {
+        if (!tryGet(k, &def, len) && len)
+        {
+            *len = def ? strlen(def) : 0;
+        }
+        return def;
+    }
+
 } // namespace tjson